@@ -55,6 +55,44 @@ static const char b64_table[] = {
 extern "C" {
 #endif
 
+/**
+ * Instruction sets `b64_encode_to_level' can use.
+ */
+
+#define B64_SCALAR 0
+#define B64_SSSE3  1
+#define B64_AVX2   2
+
+/**
+ * Exact length of the base64 encoding of `size_t' bytes, padding
+ * included and without a terminating `\0'.
+ */
+
+#define b64_encoded_size(len) (((len) + 2) / 3 * 4)
+
+/**
+ * Returns the best of the levels above this CPU supports.
+ */
+
+int
+b64_simd_level (void);
+
+/**
+ * Encode `unsigned char *' source with `size_t' size into `char *'
+ * destination, which must have room for `b64_encoded_size' bytes.
+ * Returns the number of bytes written. No `\0' is added.
+ */
+
+size_t
+b64_encode_to (const unsigned char *, size_t, char *);
+
+/**
+ * Same as `b64_encode_to', limited to the instructions of `int' level.
+ */
+
+size_t
+b64_encode_to_level (const unsigned char *, size_t, char *, int);
+
 /**
  * Encode `unsigned char *' source with `size_t' size.
  * Returns a `char *' base64 encoded string.
@@ -63,6 +101,35 @@ extern "C" {
 char *
 b64_encode (const unsigned char *, size_t);
 
+/**
+ * Most bytes `size_t' characters of base64 decode to.
+ */
+
+#define b64_decoded_size(len) ((len) / 4 * 3 + 2)
+
+/**
+ * What `b64_decode_to' returns for input that is not base64.
+ */
+
+#define B64_INVALID ((size_t) -1)
+
+/**
+ * Decode `char *' source with `size_t' size into `unsigned char *'
+ * destination, which must have room for `b64_decoded_size' bytes or be
+ * the source itself. Whitespace is skipped and padding is optional.
+ * Returns the number of bytes written or `B64_INVALID'.
+ */
+
+size_t
+b64_decode_to (const char *, size_t, unsigned char *);
+
+/**
+ * Same as `b64_decode_to', limited to the instructions of `int' level.
+ */
+
+size_t
+b64_decode_to_level (const char *, size_t, unsigned char *, int);
+
 /**
  * Decode `char *' source with `size_t' size.
  * Returns a `unsigned char *' base64 decoded string.
@@ -0,0 +1,221 @@
+
+/**
+ * `decode.c' - b64
+ *
+ * copyright (c) 2014 joseph werle
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "b64.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define B64_X86 1
+#  include <immintrin.h>
+#endif
+
+#ifdef b64_USE_CUSTOM_MALLOC
+extern void* b64_malloc(size_t);
+#endif
+
+#ifdef b64_USE_CUSTOM_REALLOC
+extern void* b64_realloc(void*, size_t);
+#endif
+
+// value of each character in `b64_table', -1 for the rest
+static const signed char b64_values[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+  52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+  -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+  -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+  41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+#ifdef B64_X86
+
+/**
+ * The vector decoders follow Wojciech Muła's scheme: the nibbles of each
+ * character index two tables whose entries share a bit only for characters
+ * outside the alphabet, a third table keyed by the high nibble gives the
+ * offset to the 6 bit value, and two multiply-adds pack 4 values into 3
+ * bytes. A block holding anything else, whitespace and `=' included, ends
+ * the vector loop and is left to the scalar one.
+ *
+ * Each block stores a whole vector of which only 3/4 is output, so the
+ * loops stop while at least another block of input follows. That keeps the
+ * stores within 3/4 of the input and behind the bytes still to be read,
+ * which lets `dst' be `src'.
+ */
+
+__attribute__((target("ssse3")))
+static size_t
+b64_decode_ssse3 (const char *src, size_t len, unsigned char *dst) {
+  const __m128i lut_lo = _mm_setr_epi8(
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8(
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  size_t i = 0;
+  for (; len - i >= 32; i += 16, dst += 12) {
+    __m128i in = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i hi = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+    __m128i lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+    __m128i bad = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo), _mm_shuffle_epi8(lut_hi, hi));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xffff) break;
+
+    __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(slash, hi));
+    in = _mm_add_epi8(in, roll);
+
+    __m128i ab_bc = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    __m128i out = _mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+    out = _mm_shuffle_epi8(out, _mm_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i *) dst, out);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+b64_decode_avx2 (const char *src, size_t len, unsigned char *dst) {
+  const __m256i lut_lo = _mm256_setr_epi8(
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m256i lut_hi = _mm256_setr_epi8(
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  size_t i = 0;
+  for (; len - i >= 64; i += 32, dst += 24) {
+    __m256i in = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+    __m256i lo = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+    __m256i bad = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo), _mm256_shuffle_epi8(lut_hi, hi));
+    if (!_mm256_testz_si256(bad, bad)) break;
+
+    __m256i slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+    __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(slash, hi));
+    in = _mm256_add_epi8(in, roll);
+
+    __m256i ab_bc = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+    __m256i out = _mm256_madd_epi16(ab_bc, _mm256_set1_epi32(0x00011000));
+    out = _mm256_shuffle_epi8(out, _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    // the 12 bytes of each lane next to each other
+    out = _mm256_permutevar8x32_epi32(out, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+    _mm256_storeu_si256((__m256i *) dst, out);
+  }
+  // see b64_encode_avx2
+  _mm256_zeroupper();
+  return i;
+}
+
+#endif
+
+size_t
+b64_decode_to_level (const char *src, size_t len, unsigned char *dst, int level) {
+  size_t i = 0;
+  unsigned char *out = dst;
+  // bits of the group being read and how many characters it has
+  unsigned int v = 0;
+  int n = 0;
+  int pad = 0;
+
+  while (i < len) {
+#ifdef B64_X86
+    // the vector loops only start at a group boundary
+    if (0 == n && 0 == pad) {
+      size_t k = 0;
+      if (level >= B64_AVX2) {
+        k = b64_decode_avx2(src + i, len - i, out);
+      }
+      if (level >= B64_SSSE3) {
+        k += b64_decode_ssse3(src + i + k, len - i - k, out + k / 4 * 3);
+      }
+      i += k;
+      out += k / 4 * 3;
+    }
+#endif
+
+    // a stretch in the scalar loop, then back to the vector ones
+    size_t end = len - i > 64 ? i + 64 : len;
+    for (; i < end; i++) {
+      unsigned char c = src[i];
+      if (' ' == c || '\n' == c || '\r' == c || '\t' == c || '\f' == c) continue;
+      if ('=' == c) {
+        // only the last 2 characters of a group can be padding
+        if (n < 2) return B64_INVALID;
+        pad = 1;
+        continue;
+      }
+      if (pad || b64_values[c] < 0) return B64_INVALID;
+      v = (v << 6) | b64_values[c];
+      if (4 == ++n) {
+        *out++ = v >> 16;
+        *out++ = v >> 8;
+        *out++ = v;
+        v = 0;
+        n = 0;
+      }
+    }
+  }
+
+  // unpadded remainder
+  if (1 == n) return B64_INVALID;
+  if (2 == n) {
+    *out++ = v >> 4;
+  } else if (3 == n) {
+    *out++ = v >> 10;
+    *out++ = v >> 2;
+  }
+
+  return out - dst;
+}
+
+size_t
+b64_decode_to (const char *src, size_t len, unsigned char *dst) {
+  return b64_decode_to_level(src, len, dst, b64_simd_level());
+}
+
+unsigned char *
+b64_decode (const char *src, size_t len) {
+  return b64_decode_ex(src, len, NULL);
+}
+
+unsigned char *
+b64_decode_ex (const char *src, size_t len, size_t *decsize) {
+  unsigned char *dec = b64_malloc(b64_decoded_size(len) + 1);
+  if (NULL == dec) { return NULL; }
+
+  size_t size = b64_decode_to(src, len, dec);
+  if (B64_INVALID == size) {
+    free(dec);
+    return NULL;
+  }
+
+  dec[size] = '\0';
+  if (NULL != decsize) { *decsize = size; }
+  return dec;
+}
@@ -9,6 +9,11 @@
 #include <stdlib.h>
 #include "b64.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#  define B64_X86 1
+#  include <immintrin.h>
+#endif
+
 #ifdef b64_USE_CUSTOM_MALLOC
 extern void* b64_malloc(size_t);
 #endif
@@ -17,77 +22,160 @@ extern void* b64_malloc(size_t);
 extern void* b64_realloc(void*, size_t);
 #endif
 
-char *
-b64_encode (const unsigned char *src, size_t len) {
-  int i = 0;
-  int j = 0;
-  b64_buffer_t encbuf;
-  size_t size = 0;
-  unsigned char buf[4];
-  unsigned char tmp[3];
-
-  // alloc
-  if(b64_buf_malloc(&encbuf) == -1) { return NULL; }
-
-  // parse until end of source
-  while (len--) {
-    // read up to 3 bytes at a time into `tmp'
-    tmp[i++] = *(src++);
-
-    // if 3 bytes read then encode into `buf'
-    if (3 == i) {
-      buf[0] = (tmp[0] & 0xfc) >> 2;
-      buf[1] = ((tmp[0] & 0x03) << 4) + ((tmp[1] & 0xf0) >> 4);
-      buf[2] = ((tmp[1] & 0x0f) << 2) + ((tmp[2] & 0xc0) >> 6);
-      buf[3] = tmp[2] & 0x3f;
-
-      // allocate 4 new byts for `enc` and
-      // then translate each encoded buffer
-      // part by index from the base 64 index table
-      // into `encbuf.ptr' unsigned char array
-      if (b64_buf_realloc(&encbuf, size + 4) == -1) return NULL;
-
-      for (i = 0; i < 4; ++i) {
-        encbuf.ptr[size++] = b64_table[buf[i]];
-      }
-
-      // reset index
-      i = 0;
-    }
+#ifdef B64_X86
+
+/**
+ * The vector encoders follow Wojciech Muła's scheme: spread each 3 input
+ * bytes over a 32 bit lane, move the four 6 bit indices into place with
+ * two multiplies, then turn indices into characters by adding an offset
+ * looked up with a byte shuffle. They only consume whole blocks and leave
+ * the rest to the scalar loop, and only read bytes inside `src'.
+ */
+
+__attribute__((target("ssse3")))
+static inline __m128i
+b64_sse_encode_block (__m128i in) {
+  // bytes 0..11 into lanes as [b1 b0 b2 b1]
+  in = _mm_shuffle_epi8(in, _mm_setr_epi8(
+    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+
+  __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  __m128i indices = _mm_or_si128(t1, t3);
+
+  // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+  __m128i slot = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  slot = _mm_or_si128(slot, _mm_and_si128(upper, _mm_set1_epi8(13)));
+  __m128i offsets = _mm_shuffle_epi8(_mm_setr_epi8(
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+    '/' - 63, 'A', 0, 0), slot);
+  return _mm_add_epi8(indices, offsets);
+}
+
+// 12 bytes in, 16 out per block
+__attribute__((target("ssse3")))
+static size_t
+b64_encode_ssse3 (const unsigned char *src, size_t len, char *dst) {
+  size_t i = 0;
+  for (; len - i >= 16; i += 12, dst += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *) (src + i));
+    _mm_storeu_si128((__m128i *) dst, b64_sse_encode_block(in));
   }
+  return i;
+}
 
-  // remainder
-  if (i > 0) {
-    // fill `tmp' with `\0' at most 3 times
-    for (j = i; j < 3; ++j) {
-      tmp[j] = '\0';
-    }
-
-    // perform same codec as above
-    buf[0] = (tmp[0] & 0xfc) >> 2;
-    buf[1] = ((tmp[0] & 0x03) << 4) + ((tmp[1] & 0xf0) >> 4);
-    buf[2] = ((tmp[1] & 0x0f) << 2) + ((tmp[2] & 0xc0) >> 6);
-    buf[3] = tmp[2] & 0x3f;
-
-    // perform same write to `encbuf->ptr` with new allocation
-    for (j = 0; (j < i + 1); ++j) {
-      if (b64_buf_realloc(&encbuf, size + 1) == -1) return NULL;
-
-      encbuf.ptr[size++] = b64_table[buf[j]];
-    }
-
-    // while there is still a remainder
-    // append `=' to `encbuf.ptr'
-    while ((i++ < 3)) {
-      if (b64_buf_realloc(&encbuf, size + 1) == -1) return NULL;
-
-      encbuf.ptr[size++] = '=';
-    }
+__attribute__((target("avx2")))
+static inline __m256i
+b64_avx2_encode_block (__m256i in) {
+  in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+
+  __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+  __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+  __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+  __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+  __m256i indices = _mm256_or_si256(t1, t3);
+
+  __m256i slot = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+  __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+  slot = _mm256_or_si256(slot, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+  __m256i offsets = _mm256_shuffle_epi8(_mm256_setr_epi8(
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+    '/' - 63, 'A', 0, 0,
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+    '/' - 63, 'A', 0, 0), slot);
+  return _mm256_add_epi8(indices, offsets);
+}
+
+// 24 bytes in, 32 out per block, each 128 bit lane taking 12 of them
+__attribute__((target("avx2")))
+static size_t
+b64_encode_avx2 (const unsigned char *src, size_t len, char *dst) {
+  size_t i = 0;
+  for (; len - i >= 28; i += 24, dst += 32) {
+    __m256i in = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (src + i))),
+      _mm_loadu_si128((const __m128i *) (src + i + 12)), 1);
+    _mm256_storeu_si256((__m256i *) dst, b64_avx2_encode_block(in));
   }
+  // GCC leaves the upper halves dirty when it can't see the caller, which
+  // makes every SSE instruction afterwards wait
+  _mm256_zeroupper();
+  return i;
+}
 
-  // Make sure we have enough space to add '\0' character at end.
-  if (b64_buf_realloc(&encbuf, size + 1) == -1) return NULL;
-  encbuf.ptr[size] = '\0';
+#endif
+
+int
+b64_simd_level (void) {
+#ifdef B64_X86
+  static int level = -1;
+  if (level < 0) {
+    __builtin_cpu_init();
+    level = __builtin_cpu_supports("avx2") ? B64_AVX2
+          : __builtin_cpu_supports("ssse3") ? B64_SSSE3
+          : B64_SCALAR;
+  }
+  return level;
+#else
+  return B64_SCALAR;
+#endif
+}
+
+size_t
+b64_encode_to_level (const unsigned char *src, size_t len, char *dst, int level) {
+  size_t i = 0;
+  char *out = dst;
+
+#ifdef B64_X86
+  if (level >= B64_AVX2) {
+    i = b64_encode_avx2(src, len, out);
+  }
+  if (level >= B64_SSSE3) {
+    i += b64_encode_ssse3(src + i, len - i, out + i / 3 * 4);
+  }
+  out += i / 3 * 4;
+#endif
+
+  // whole groups of 3 bytes
+  for (; len - i >= 3; i += 3) {
+    unsigned int v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+    *out++ = b64_table[v >> 18];
+    *out++ = b64_table[(v >> 12) & 0x3f];
+    *out++ = b64_table[(v >> 6) & 0x3f];
+    *out++ = b64_table[v & 0x3f];
+  }
+
+  // remainder, padded with `='
+  if (i < len) {
+    unsigned int v = src[i] << 16;
+    if (len - i == 2) v |= src[i + 1] << 8;
+    *out++ = b64_table[v >> 18];
+    *out++ = b64_table[(v >> 12) & 0x3f];
+    *out++ = len - i == 2 ? b64_table[(v >> 6) & 0x3f] : '=';
+    *out++ = '=';
+  }
+
+  return out - dst;
+}
+
+size_t
+b64_encode_to (const unsigned char *src, size_t len, char *dst) {
+  return b64_encode_to_level(src, len, dst, b64_simd_level());
+}
+
+char *
+b64_encode (const unsigned char *src, size_t len) {
+  char *enc = b64_malloc(b64_encoded_size(len) + 1);
+  if (NULL == enc) { return NULL; }
 
-  return encbuf.ptr;
+  enc[b64_encode_to(src, len, enc)] = '\0';
+  return enc;
 }
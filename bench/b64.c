@@ -0,0 +1,78 @@
+// Encodes random data of a few sizes to base64 and decodes it back with each
+// instruction set the CPU supports, checking that they all agree with the
+// scalar code. Speed is in megabytes of raw data per second.
+#include <string.h>
+#include "bench.h"
+#include "../b64/b64.h"
+
+static char *level_names[] = {"scalar", "ssse3", "avx2"};
+
+void run_encode(unsigned char *data, size_t len, int level, char *out, char *expected) {
+    size_t size = 0;
+    BenchTimer timer = bench_start();
+    do {
+        size = b64_encode_to_level(data, len, out, level);
+    } while (bench_next(&timer));
+    char *check = "";
+    if (size != b64_encoded_size(len) || memcmp(out, expected, size) != 0) check = "  MISMATCH";
+    printf("  encode %-7s %8zu rounds  %9.1f MB/s%s\n", level_names[level], timer.rounds, len*timer.rounds/timer.elapsed/1e6, check);
+}
+
+// `encoded` is the encoding of `data`
+void run_decode(unsigned char *data, size_t len, char *encoded, int level, unsigned char *out) {
+    size_t size = 0;
+    size_t encoded_len = b64_encoded_size(len);
+    BenchTimer timer = bench_start();
+    do {
+        size = b64_decode_to_level(encoded, encoded_len, out, level);
+    } while (bench_next(&timer));
+    char *check = "";
+    if (size != len || memcmp(out, data, size) != 0) check = "  MISMATCH";
+    printf("  decode %-7s %8zu rounds  %9.1f MB/s%s\n", level_names[level], timer.rounds, len*timer.rounds/timer.elapsed/1e6, check);
+}
+
+int main() {
+    size_t sizes[] = {100, 4*1024, 64*1024, 1024*1024, 16*1024*1024};
+    size_t max_len = sizes[sizeof(sizes)/sizeof(sizes[0]) - 1];
+    unsigned char *data = malloc(max_len);
+    char *out = malloc(b64_encoded_size(max_len));
+    char *expected = malloc(b64_encoded_size(max_len));
+    unsigned char *decoded = malloc(b64_decoded_size(b64_encoded_size(max_len)));
+    srand(1);
+    for (size_t i = 0; i < max_len; i++) data[i] = rand();
+    int best = b64_simd_level();
+    for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        printf("%zu bytes:\n", sizes[s]);
+        b64_encode_to_level(data, sizes[s], expected, B64_SCALAR);
+        for (int level = B64_SCALAR; level <= best; level++) run_encode(data, sizes[s], level, out, expected);
+        for (int level = B64_SCALAR; level <= best; level++) run_decode(data, sizes[s], expected, level, decoded);
+    }
+    // Every length around the block sizes, against the scalar encoder, and
+    // back again in place with line breaks as in MIME
+    for (size_t len = 0; len < 200; len++) {
+        for (int level = B64_SCALAR; level <= best; level++) {
+            size_t size = b64_encode_to_level(data, len, out, level);
+            b64_encode_to_level(data, len, expected, B64_SCALAR);
+            if (size != b64_encoded_size(len) || memcmp(out, expected, size) != 0) {
+                printf("MISMATCH: %s encoding %zu bytes\n", level_names[level], len);
+            }
+            size_t wrapped = 0;
+            for (size_t i = 0; i < size; i++) {
+                if (i > 0 && i % 76 == 0) out[wrapped++] = '\n';
+                out[wrapped++] = expected[i];
+            }
+            size = b64_decode_to_level(out, wrapped, (unsigned char*)out, level);
+            if (size != len || memcmp(out, data, len) != 0) {
+                printf("MISMATCH: %s decoding %zu bytes\n", level_names[level], len);
+            }
+        }
+    }
+    if (b64_decode_to("QUJD=", 5, decoded) != B64_INVALID || b64_decode_to("QU*D", 4, decoded) != B64_INVALID) {
+        printf("MISMATCH: invalid input decoded\n");
+    }
+    free(decoded);
+    free(expected);
+    free(out);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,54 @@
+// What the benchmarks share: a clock, reading the files given on the command
+// line, and repeating a variant until it ran long enough to be timed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Every variant is repeated for at least this long
+#define MIN_SECONDS 0.5
+
+double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// The contents of `path`, NUL-terminated so text can be scanned as a string
+char *read_file(char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(*len + 1);
+    if (fread(data, 1, *len, f) != *len) {
+        free(data);
+        data = NULL;
+    } else {
+        data[*len] = '\0';
+    }
+    fclose(f);
+    return data;
+}
+
+typedef struct {
+    size_t rounds;
+    double start;
+    double elapsed;
+} BenchTimer;
+
+// Used as
+//     BenchTimer timer = bench_start();
+//     do { ... } while (bench_next(&timer));
+BenchTimer bench_start() {
+    BenchTimer timer = {.start = now_s()};
+    return timer;
+}
+
+// Counts a round, false once the rounds took MIN_SECONDS
+bool bench_next(BenchTimer *timer) {
+    timer->rounds++;
+    timer->elapsed = now_s() - timer->start;
+    return timer->elapsed < MIN_SECONDS;
+}
@@ -0,0 +1,101 @@
+// Decodes every image given on the command line with stb_image and with the
+// native decoders from decoder.h, and JPEGs also at 1/2, 1/4 and 1/8 scale.
+// Speed is in megapixels of the source image per second. Before timing, the
+// native decoder is checked against stb_image, bench/cmyk.jpeg covers the
+// CMYK JPEGs libjpeg leaves to us.
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "bench.h"
+#include "../bufpool.h"
+#include "../decoder.h"
+
+bool decode_stb(char *data, size_t len, int _scale, BufPool *_pool) {
+    int w, h, n;
+    unsigned char *pixels = stbi_load_from_memory((unsigned char*)data, len, &w, &h, &n, 0);
+    stbi_image_free(pixels);
+    return pixels != NULL;
+}
+
+bool decode_native(char *data, size_t len, int scale, BufPool *pool) {
+    Decoder dec;
+    bool ok = decoder_init(&dec, decoder_sniff(data, len), (size_t)-1, pool) && decoder_set_scale(&dec, scale);
+    if (ok) {
+        decoder_decode(&dec, data, len);
+        ok = decoder_finish(&dec);
+    }
+    decoder_free(&dec);
+    return ok;
+}
+
+// Prints how far the native decoder's pixels are from stb_image's
+void check(char *data, size_t len, BufPool *pool) {
+    Decoder dec;
+    bool ok = decoder_init(&dec, decoder_sniff(data, len), (size_t)-1, pool);
+    if (ok) {
+        decoder_decode(&dec, data, len);
+        ok = decoder_finish(&dec);
+    }
+    int w, h, n;
+    unsigned char *expected = ok ? stbi_load_from_memory((unsigned char*)data, len, &w, &h, &n, dec.n) : NULL;
+    if (expected == NULL || w != dec.w || h != dec.h) {
+        printf("  %-16s failed\n", "check");
+    } else {
+        int max_diff = 0;
+        for (size_t i = 0; i < (size_t)w*h*dec.n; i++) {
+            int diff = abs(expected[i] - dec.pixels[i]);
+            if (diff > max_diff) max_diff = diff;
+        }
+        printf("  %-16s off from stb_image by at most %d\n", "check", max_diff);
+    }
+    stbi_image_free(expected);
+    decoder_free(&dec);
+}
+
+void run(char *name, char *data, size_t len, double megapixels, int scale, BufPool *pool,
+         bool (*decode)(char*, size_t, int, BufPool*)) {
+    BenchTimer timer = bench_start();
+    do {
+        if (!decode(data, len, scale, pool)) {
+            printf("  %-16s failed\n", name);
+            return;
+        }
+    } while (bench_next(&timer));
+    printf("  %-16s %6zu rounds  %9.2f ms/image  %8.1f MP/s\n", name, timer.rounds,
+        timer.elapsed/timer.rounds*1000, megapixels*timer.rounds/timer.elapsed);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        dprintf(2, "ERROR: %s <image>...\n", argv[0]);
+        return 1;
+    }
+    BufPool pool;
+    buf_pool_init(&pool, 1024*1024*1024);
+    for (int i = 1; i < argc; i++) {
+        size_t len;
+        char *data = read_file(argv[i], &len);
+        char *format = data ? decoder_sniff(data, len) : NULL;
+        int w, h;
+        if (format == NULL || !decoder_info(data, len, format, &w, &h)) {
+            dprintf(2, "ERROR: Can't read %s\n", argv[i]);
+            free(data);
+            continue;
+        }
+        double megapixels = (double)w*h/1e6;
+        printf("%s: %s %dx%d, %zu bytes\n", argv[i], format, w, h, len);
+        // stb_image reads neither WebP nor AVIF
+        if (strcmp(format, "webp") != 0 && strcmp(format, "avif") != 0) {
+            check(data, len, &pool);
+            run("stb_image", data, len, megapixels, 1, &pool, decode_stb);
+        }
+        run("native", data, len, megapixels, 1, &pool, decode_native);
+        if (strcmp(format, "jpeg") == 0) {
+            run("native 1/2", data, len, megapixels, 2, &pool, decode_native);
+            run("native 1/4", data, len, megapixels, 4, &pool, decode_native);
+            run("native 1/8", data, len, megapixels, 8, &pool, decode_native);
+        }
+        free(data);
+    }
+    buf_pool_free(&pool);
+    return 0;
+}
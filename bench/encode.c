@@ -0,0 +1,115 @@
+// Encodes every image given on the command line into each format, once with
+// an encoder context set up and torn down per image and once with a single
+// context reused for all rounds. Speed is in megapixels per second, and
+// allocations are the calls to malloc, calloc and realloc per image, by us
+// and by the codec libraries.
+#include <string.h>
+#include "bench.h"
+#include "../bufpool.h"
+#include "../yuv.h"
+#include "../sink.h"
+#include "../decoder.h"
+#include "../encoder.h"
+
+// Window of the encoders' own buffer, as in main.c
+#define ENCODE_WINDOW 256*1024
+
+// Encoded images go into buffers from here, as in main.c
+static BufPool encoded_pool;
+
+// The libraries' calls to malloc land here instead of in libc
+static size_t allocations;
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+// `reused` is NULL to set up a context for every image
+void run(char *format, char *name, Decoder *dec, Yuv420 *yuv, EncoderSettings *settings, Encoder *reused) {
+    double megapixels = (double)dec->w*dec->h/1e6;
+    size_t size = 0;
+    size_t allocations_before = allocations;
+    BenchTimer timer = bench_start();
+    do {
+        Encoder fresh;
+        Encoder *enc = reused;
+        if (enc == NULL) {
+            enc = &fresh;
+            encoder_init(enc, ENCODE_WINDOW, settings);
+        }
+        Sink sink;
+        sink_memory(&sink, &encoded_pool, (size_t)dec->w*dec->h/2 + 4096);
+        bool ok = encoder_encode(enc, format, dec->pixels, dec->w, dec->h, dec->n, yuv, &sink) && sink_finish(&sink);
+        size = sink_size(&sink);
+        sink_memory_release(&sink);
+        if (reused == NULL) encoder_free(enc);
+        if (!ok) {
+            printf("  %-5s %-7s failed\n", format, name);
+            return;
+        }
+    } while (bench_next(&timer));
+    printf("  %-5s %-7s %6zu rounds  %9.2f ms/image  %8.1f MP/s  %8.1f allocs/image  %9zu bytes\n",
+        format, name, timer.rounds, timer.elapsed/timer.rounds*1000, megapixels*timer.rounds/timer.elapsed,
+        (double)(allocations - allocations_before)/timer.rounds, size);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        dprintf(2, "ERROR: %s <image>...\n", argv[0]);
+        return 1;
+    }
+    EncoderSettings settings = {
+        .quality = 80,
+        .avif_speed = 8,
+        .avif_quality = 80,
+        .avif_threads = 1,
+        .avif_tile_log2 = 0,
+    };
+    char *formats[] = {"png", "jpeg", "webp", "avif"};
+    buf_pool_init(&encoded_pool, 64*1024*1024);
+    for (int i = 1; i < argc; i++) {
+        size_t len;
+        char *data = read_file(argv[i], &len);
+        char *format = data ? decoder_sniff(data, len) : NULL;
+        Decoder dec;
+        if (format == NULL || !decoder_init(&dec, format, (size_t)-1, NULL)) {
+            dprintf(2, "ERROR: Can't read %s\n", argv[i]);
+            free(data);
+            continue;
+        }
+        Yuv420 yuv;
+        if (!decoder_decode(&dec, data, len) || !decoder_finish(&dec) ||
+            !yuv420_from_rgb(&yuv, dec.pixels, dec.w, dec.h, dec.n, NULL)) {
+            dprintf(2, "ERROR: Can't decode %s\n", argv[i]);
+            decoder_free(&dec);
+            free(data);
+            continue;
+        }
+        printf("%s: %s %dx%d, %zu bytes\n", argv[i], format, dec.w, dec.h, len);
+        for (size_t f = 0; f < sizeof(formats)/sizeof(formats[0]); f++) {
+            run(formats[f], "fresh", &dec, &yuv, &settings, NULL);
+            Encoder reused;
+            encoder_init(&reused, ENCODE_WINDOW, &settings);
+            run(formats[f], "reused", &dec, &yuv, &settings, &reused);
+            encoder_free(&reused);
+        }
+        yuv420_free(&yuv, NULL);
+        decoder_free(&dec);
+        free(data);
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+// Scans HTML pages for images with html_scan, all at once and as if the
+// page arrived in 16 KB pieces. Pages are the files given on the command
+// line, or a generated one mixing text, scripts, lazy loaded and responsive
+// images when there are none. Speed is in megabytes of HTML per second.
+#define _GNU_SOURCE
+#include <string.h>
+#include "bench.h"
+#include "../html.h"
+
+#define GENERATED_SIZE 16*1024*1024
+#define PIECE 16*1024
+
+static char *blocks[] = {
+    "<div class=\"card\"><h2>Lorem ipsum dolor sit amet</h2><p>Consectetur adipiscing elit, sed do eiusmod "
+    "tempor incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, quis nostrud exercitation "
+    "ullamco laboris nisi ut aliquip ex ea commodo consequat.</p><a href=\"/article/%d?ref=home&amp;pos=1\">More</a></div>\n",
+    "<img src=\"/img/%d.jpg\" alt=\"Photo\" width=\"640\" height=\"480\" loading=\"lazy\" decoding=\"async\">\n",
+    "<picture><source srcset=\"/img/%d.avif 1x, /img/2x.avif 2x\" type=\"image/avif\"><source srcset=\"/img/w640.webp 640w, "
+    "/img/w1280.webp 1280w\" type=\"image/webp\"><img src=\"/img/fallback.jpg\" alt=\"\"></picture>\n",
+    "<img class=\"lazyload\" data-src=\"https://cdn.example.com/i/%d.png?w=800&amp;q=75\" "
+    "src=\"data:image/gif;base64,R0lGODlhAQABAIAAAAAAAP///yH5BAEAAAAALAAAAAABAAEAAAIBRAA7\">\n",
+    "<section style=\"background-image: url(&quot;/bg/%d.webp&quot;); background-size: cover\"><span>Hero</span></section>\n",
+    "<script>window.__STATE__ = {\"items\": [%d, 2, 3], \"html\": \"<img src=\\\"x.png\\\">\"}; "
+    "for (var i = 0; i < 10; i++) { if (i < 5) console.log(i); }</script>\n",
+    "<!-- tracking pixel %d <img src=\"/pixel.gif\"> -->\n",
+    "<ul class=\"nav\"><li><a href=\"/a\">Home</a></li><li><a href=\"/b\">News %d</a></li><li><a href=\"/c\">Sport</a></li></ul>\n",
+};
+
+char *generate(size_t *len) {
+    char *page = malloc(GENERATED_SIZE + 1024);
+    size_t n = sprintf(page, "<!DOCTYPE html><html><head><title>Generated</title></head><body>\n");
+    for (int i = 0; n < GENERATED_SIZE; i++) {
+        n += sprintf(page + n, blocks[(i*7 + i/8) % (sizeof(blocks)/sizeof(blocks[0]))], i);
+    }
+    n += sprintf(page + n, "</body></html>\n");
+    *len = n;
+    return page;
+}
+
+void count_image(HtmlImage *_image, void *_ctx) {}
+
+size_t scan_whole(char *page, size_t len) {
+    HtmlScanner scanner;
+    html_scanner_init(&scanner, count_image, NULL, NULL);
+    html_scan(&scanner, page, len, true);
+    return scanner.images;
+}
+
+size_t scan_pieces(char *page, size_t len) {
+    HtmlScanner scanner;
+    html_scanner_init(&scanner, count_image, NULL, NULL);
+    for (size_t arrived = PIECE; arrived < len; arrived += PIECE) html_scan(&scanner, page, arrived, false);
+    html_scan(&scanner, page, len, true);
+    return scanner.images;
+}
+
+void run(char *name, size_t (*scan)(char*, size_t), char *page, size_t len) {
+    size_t images = 0;
+    BenchTimer timer = bench_start();
+    do {
+        images = scan(page, len);
+    } while (bench_next(&timer));
+    printf("  %-8s %6zu rounds  %9.3f ms/page  %8.1f MB/s  %7zu images\n",
+        name, timer.rounds, timer.elapsed/timer.rounds*1000, len*timer.rounds/timer.elapsed/1e6, images);
+}
+
+void bench(char *name, char *page, size_t len) {
+    printf("%s: %zu bytes\n", name, len);
+    run("whole", scan_whole, page, len);
+    run("pieces", scan_pieces, page, len);
+}
+
+int main(int argc, char **argv) {
+    size_t len;
+    if (argc < 2) {
+        char *page = generate(&len);
+        bench("generated", page, len);
+        free(page);
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        char *page = read_file(argv[i], &len);
+        if (page == NULL) {
+            dprintf(2, "ERROR: Can't read %s\n", argv[i]);
+            continue;
+        }
+        bench(argv[i], page, len);
+        free(page);
+    }
+    return 0;
+}
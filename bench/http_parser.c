@@ -0,0 +1,80 @@
+// Measures http_next_request on pipelined input, both when the whole batch
+// is already buffered and when it trickles in through small reads.
+#define _GNU_SOURCE
+#include "bench.h"
+#include "../http.h"
+
+#define PIPELINE 64
+#define ROUNDS 20000
+#define TRICKLE_READ 16
+
+static char *sample =
+    "GET /report?page=https%3A%2F%2Fexample.com%2Fnews%3Fid%3D42&prerender=1 HTTP/1.1\r\n"
+    "Host: localhost:3456\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:131.0) Gecko/20100101 Firefox/131.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: http://localhost:3456/\r\n"
+    "If-None-Match: \"5f2b-18c7e3a1b40\"\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static HttpReq request;
+
+// Parses every request in `input`, revealing `step` more bytes per call
+size_t parse_all(HttpConn *conn, char *input, size_t len, size_t step) {
+    size_t parsed = 0;
+    size_t off = 0;
+    size_t avail = 0;
+    http_parser_reset(&conn->parser);
+    while (off < len) {
+        conn->in = input + off;
+        conn->in_cap = len - off;
+        if (avail < off + step) avail = off + step;
+        if (avail > len) avail = len;
+        conn->in_len = avail - off;
+        int req_len = http_next_request(conn, &request);
+        if (req_len < 0) {
+            dprintf(2, "ERROR: parser rejected sample with %d\n", -req_len);
+            exit(1);
+        }
+        if (req_len == 0) {
+            avail += step;
+            continue;
+        }
+        off += req_len;
+        parsed++;
+    }
+    return parsed;
+}
+
+void run(char *name, char *pristine, char *input, size_t len, size_t step) {
+    HttpConn conn = {0};
+    size_t parsed = 0;
+    double start = now_s();
+    for (int i = 0; i < ROUNDS; i++) {
+        // The parser NUL-terminates lines in place
+        memcpy(input, pristine, len);
+        parsed += parse_all(&conn, input, len, step);
+    }
+    double elapsed = now_s() - start;
+    printf("%-24s %10zu requests  %8.3f s  %12.0f req/s  %8.1f MB/s\n", name, parsed, elapsed,
+        parsed/elapsed, (double)len*ROUNDS/elapsed/1024/1024);
+}
+
+int main() {
+    size_t sample_len = strlen(sample);
+    size_t len = sample_len*PIPELINE;
+    char *pristine = malloc(len);
+    char *input = malloc(len);
+    for (int i = 0; i < PIPELINE; i++) memcpy(pristine + i*sample_len, sample, sample_len);
+    
+    printf("%d pipelined requests of %zu bytes, %d rounds\n", PIPELINE, sample_len, ROUNDS);
+    run("buffered", pristine, input, len, len);
+    run("trickled (16 B reads)", pristine, input, len, TRICKLE_READ);
+    
+    free(pristine);
+    free(input);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef struct {
+    char *ptr;
+    size_t cap;
+} Buf;
+
+// Big buffers given back for reuse, so steady traffic stops hitting malloc
+// and the page faults of fresh allocations. Any thread may get and put.
+// Buffers beyond `max_bytes` of idle memory are freed instead of kept.
+typedef struct {
+    pthread_mutex_t lock;
+    Buf *bufs;
+    size_t len;
+    size_t cap;
+    size_t bytes;
+    size_t max_bytes;
+} BufPool;
+
+void buf_pool_init(BufPool *pool, size_t max_bytes) {
+    memset(pool, 0, sizeof(BufPool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->max_bytes = max_bytes;
+}
+
+// Takes the smallest pooled buffer of at least `size` bytes, or allocates one.
+// Buffers more than twice as big as asked for are left for bigger requests.
+Buf buf_pool_get(BufPool *pool, size_t size) {
+    pthread_mutex_lock(&pool->lock);
+    size_t best = pool->len;
+    for (size_t i = 0; i < pool->len; i++) {
+        size_t cap = pool->bufs[i].cap;
+        if (cap >= size && cap/2 <= size && (best == pool->len || cap < pool->bufs[best].cap)) {
+            best = i;
+        }
+    }
+    if (best == pool->len) {
+        pthread_mutex_unlock(&pool->lock);
+        Buf buf = {.ptr = malloc(size), .cap = size};
+        return buf;
+    }
+    Buf buf = pool->bufs[best];
+    pool->bufs[best] = pool->bufs[--pool->len];
+    pool->bytes -= buf.cap;
+    pthread_mutex_unlock(&pool->lock);
+    return buf;
+}
+
+void buf_pool_put(BufPool *pool, Buf buf) {
+    if (buf.ptr == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->bytes + buf.cap > pool->max_bytes) {
+        pthread_mutex_unlock(&pool->lock);
+        free(buf.ptr);
+        return;
+    }
+    if (pool->len == pool->cap) {
+        pool->cap = pool->cap ? pool->cap*2 : 16;
+        pool->bufs = realloc(pool->bufs, pool->cap*sizeof(Buf));
+    }
+    pool->bufs[pool->len++] = buf;
+    pool->bytes += buf.cap;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void buf_pool_free(BufPool *pool) {
+    for (size_t i = 0; i < pool->len; i++) free(pool->bufs[i].ptr);
+    free(pool->bufs);
+    pthread_mutex_destroy(&pool->lock);
+}
@@ -9,7 +9,7 @@ main () {
     echo -n $B64 >> $UNAVAILABLE_H
     echo -n '"' >> $UNAVAILABLE_H
     set -x
-    gcc main.c b64/encode.c b64/buffer.c -Llib -lcurl -Iinclude -Iinclude/webp -lz -lm -lpng -ljpeg -lwebp -lsharpyuv -g -o main $W $@
+    gcc main.c b64/encode.c b64/decode.c b64/buffer.c -Llib -lcurl -Iinclude -Iinclude/webp -lz -lm -lpng -ljpeg -lwebp -lsharpyuv -lavif -g -o main $W $@
 }
 
 curl() {
@@ -17,4 +17,16 @@ curl() {
     gcc curl.c -lcurl -o curl $W $1
 }
 
-main $@
+bench() {
+    set -x
+    gcc bench/http_parser.c b64/encode.c b64/buffer.c -O2 -o bench/http_parser $W $@
+    gcc bench/decode.c -Llib -Iinclude -Iinclude/webp -lwebp -lpng -ljpeg -lavif -lz -lm -O2 -o bench/decode $W $@
+    gcc bench/encode.c -Llib -Iinclude -Iinclude/webp -lwebp -lsharpyuv -lpng -ljpeg -lavif -lz -lm -O2 -o bench/encode $W $@
+    gcc bench/html.c -O2 -o bench/html $W $@
+    gcc bench/b64.c b64/encode.c b64/decode.c b64/buffer.c -O2 -o bench/b64 $W $@
+}
+
+case "$1" in
+    bench) shift; bench $@ ;;
+    *) main $@ ;;
+esac
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Finds what a stylesheet refers to: stylesheets it pulls in with @import
+// and everything else in url(), which is mostly background images. Strings
+// and comments are skipped whole with memchr and memmem, so a url( inside
+// them doesn't count. @font-face blocks are skipped too, their url() are
+// fonts.
+
+typedef struct {
+    // Points into the stylesheet, without quotes or surrounding whitespace
+    char *url;
+    size_t url_len;
+    // From @import, so a stylesheet rather than an image
+    bool import;
+} CssRef;
+
+// Bytes that may start something we care about
+static const unsigned char css_special[256] = {
+    ['/'] = 1, ['"'] = 1, ['\''] = 1, ['('] = 1, ['@'] = 1,
+};
+
+static inline bool css_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f';
+}
+
+static inline bool css_name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+}
+
+// Returns the end of the string starting at the quote `p`
+char *css_string_end(char *p, char *end) {
+    char quote = *p++;
+    while (p < end) {
+        char *close = memchr(p, quote, end - p);
+        if (close == NULL) return end;
+        size_t backslashes = 0;
+        while (close - backslashes > p && close[-1 - (ssize_t)backslashes] == '\\') backslashes++;
+        if (backslashes % 2 == 0) return close + 1;
+        p = close + 1;
+    }
+    return end;
+}
+
+void css_emit(char *url, char *url_end, bool import, void (*found)(CssRef *ref, void *ctx), void *ctx) {
+    while (url < url_end && css_space(*url)) url++;
+    while (url_end > url && css_space(url_end[-1])) url_end--;
+    if (url_end == url) return;
+    CssRef ref = {.url = url, .url_len = url_end - url, .import = import};
+    found(&ref, ctx);
+}
+
+// Reads the argument of url( at `p`, which is right after the parenthesis,
+// and returns where it ends
+char *css_url(char *p, char *end, bool import, void (*found)(CssRef *ref, void *ctx), void *ctx) {
+    while (p < end && css_space(*p)) p++;
+    if (p < end && (*p == '"' || *p == '\'')) {
+        char *string_end = css_string_end(p, end);
+        css_emit(p + 1, string_end > p + 1 && string_end[-1] == *p ? string_end - 1 : string_end, import, found, ctx);
+        char *close = memchr(string_end, ')', end - string_end);
+        return close != NULL ? close + 1 : end;
+    }
+    char *close = memchr(p, ')', end - p);
+    if (close == NULL) close = end;
+    css_emit(p, close, import, found, ctx);
+    return close < end ? close + 1 : end;
+}
+
+// Calls `found` for each reference in `css`, in order
+void css_scan(char *css, size_t len, void (*found)(CssRef *ref, void *ctx), void *ctx) {
+    char *p = css;
+    char *end = css + len;
+    while (p < end) {
+        while (p < end && !css_special[(unsigned char)*p]) p++;
+        if (p == end) break;
+        switch (*p) {
+        case '/':
+            if (p + 1 < end && p[1] == '*') {
+                char *close = memmem(p + 2, end - p - 2, "*/", 2);
+                p = close != NULL ? close + 2 : end;
+            } else {
+                p++;
+            }
+            break;
+        case '"':
+        case '\'':
+            p = css_string_end(p, end);
+            break;
+        case '(':
+            if (p - css >= 3 && strncasecmp(p - 3, "url", 3) == 0 && (p - css == 3 || !css_name_char(p[-4]))) {
+                p = css_url(p + 1, end, false, found, ctx);
+            } else {
+                p++;
+            }
+            break;
+        case '@':
+            if (end - p > 7 && strncasecmp(p, "@import", 7) == 0 && !css_name_char(p[7])) {
+                p += 7;
+                while (p < end && css_space(*p)) p++;
+                if (p < end && (*p == '"' || *p == '\'')) {
+                    char *string_end = css_string_end(p, end);
+                    css_emit(p + 1, string_end > p + 1 && string_end[-1] == *p ? string_end - 1 : string_end, true, found, ctx);
+                    p = string_end;
+                } else if (end - p > 4 && strncasecmp(p, "url(", 4) == 0) {
+                    p = css_url(p + 4, end, true, found, ctx);
+                }
+            } else if (end - p > 10 && strncasecmp(p, "@font-face", 10) == 0) {
+                char *close = memchr(p, '}', end - p);
+                p = close != NULL ? close + 1 : end;
+            } else {
+                p++;
+            }
+            break;
+        }
+    }
+}
@@ -0,0 +1,537 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <setjmp.h>
+
+#include "webp/decode.h"
+#include "jpeglib.h"
+#include "png.h"
+#include "avif.h"
+
+// Incremental decoders for WebP, PNG and JPEG. Bytes are fed as they arrive,
+// so decoding runs alongside the download and a broken or oversized image is
+// rejected as soon as its header is in, without waiting for the rest. AVIF
+// is only buffered while fed and decoded in one go by decoder_finish, since
+// libavif needs the whole AV1 payload.
+//
+// Output is always 8-bit RGB, or RGBA when the image has alpha. The pixel
+// buffer is only allocated once the header has passed the pixel limit, is
+// taken from `pool` when there is one, and is handed over to the caller
+// together with its capacity.
+
+typedef enum {
+    DECODER_WEBP,
+    DECODER_PNG,
+    DECODER_JPEG,
+    DECODER_AVIF,
+} DecoderKind;
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} DecoderJpegError;
+
+typedef enum {
+    DECODER_JPEG_HEADER,
+    DECODER_JPEG_START,
+    DECODER_JPEG_SCANLINES,
+    DECODER_JPEG_FINISH,
+} DecoderJpegStep;
+
+typedef struct {
+    DecoderKind kind;
+    // Images with more pixels are rejected before anything is allocated
+    size_t max_pixels;
+    BufPool *pool;
+    // JPEGs are decoded at 1/scale of their size, see decoder_set_scale
+    int scale;
+    bool failed;
+    bool done;
+
+    // Known once the header has been parsed
+    int w;
+    int h;
+    int n;
+    unsigned char *pixels;
+    size_t pixels_cap;
+
+    // Bytes the decoder has not consumed yet: the WebP header before the
+    // dimensions are known, the JPEG input after a suspension, or all of an
+    // AVIF
+    unsigned char *buf;
+    size_t buf_len;
+    size_t buf_cap;
+
+    WebPIDecoder *webp;
+
+    png_structp png;
+    png_infop png_info;
+
+    struct jpeg_decompress_struct jpeg;
+    DecoderJpegError jpeg_err;
+    struct jpeg_source_mgr jpeg_src;
+    DecoderJpegStep jpeg_step;
+    // Bytes libjpeg asked to skip that have not arrived yet
+    size_t jpeg_skip;
+    // Row libjpeg writes CMYK into, for CMYK and YCCK images only
+    unsigned char *jpeg_cmyk;
+} Decoder;
+
+void decoder_buf_append(Decoder *dec, const unsigned char *data, size_t len) {
+    if (dec->buf_len + len > dec->buf_cap) {
+        dec->buf_cap = dec->buf_cap ? dec->buf_cap : 4096;
+        while (dec->buf_len + len > dec->buf_cap) dec->buf_cap *= 2;
+        dec->buf = realloc(dec->buf, dec->buf_cap);
+    }
+    memcpy(dec->buf + dec->buf_len, data, len);
+    dec->buf_len += len;
+}
+
+// Allocates the output once the dimensions are known. Both dimensions fit in
+// 31 bits, so their product can't overflow 64 bits.
+bool decoder_alloc_pixels(Decoder *dec, int w, int h, int n) {
+    if (w <= 0 || h <= 0) {
+        dprintf(2, "ERROR: Image has no pixels\n");
+        return false;
+    }
+    uint64_t pixels = (uint64_t)w*(uint64_t)h;
+    if (pixels > dec->max_pixels || pixels > SIZE_MAX/n) {
+        dprintf(2, "ERROR: %dx%d image has more than %zu pixels\n", w, h, dec->max_pixels);
+        return false;
+    }
+    size_t size = pixels*n;
+    Buf buf;
+    if (dec->pool != NULL) {
+        buf = buf_pool_get(dec->pool, size);
+    } else {
+        buf.ptr = malloc(size);
+        buf.cap = size;
+    }
+    if (buf.ptr == NULL) return false;
+    dec->w = w;
+    dec->h = h;
+    dec->n = n;
+    dec->pixels = (unsigned char*)buf.ptr;
+    dec->pixels_cap = buf.cap;
+    return true;
+}
+
+bool decoder_feed_webp(Decoder *dec, const unsigned char *data, size_t len) {
+    if (dec->webp == NULL) {
+        decoder_buf_append(dec, data, len);
+        WebPBitstreamFeatures features;
+        VP8StatusCode status = WebPGetFeatures(dec->buf, dec->buf_len, &features);
+        if (status == VP8_STATUS_NOT_ENOUGH_DATA) return true;
+        if (status != VP8_STATUS_OK) {
+            dprintf(2, "ERROR: Bad WebP header (status %d)\n", status);
+            return false;
+        }
+        int n = features.has_alpha ? 4 : 3;
+        if (!decoder_alloc_pixels(dec, features.width, features.height, n)) return false;
+        size_t size = (size_t)dec->w*dec->h*n;
+        dec->webp = WebPINewRGB(n == 4 ? MODE_RGBA : MODE_RGB, dec->pixels, size, dec->w*n);
+        if (dec->webp == NULL) return false;
+        data = dec->buf;
+        len = dec->buf_len;
+        dec->buf_len = 0;
+    }
+    VP8StatusCode status = WebPIAppend(dec->webp, data, len);
+    if (status == VP8_STATUS_OK) dec->done = true;
+    else if (status != VP8_STATUS_SUSPENDED) {
+        dprintf(2, "ERROR: WebP decoding failed (status %d)\n", status);
+        return false;
+    }
+    return true;
+}
+
+void decoder_png_error(png_structp png, png_const_charp message) {
+    dprintf(2, "ERROR: PNG decoding failed: %s\n", message);
+    png_longjmp(png, 1);
+}
+
+void decoder_png_info(png_structp png, png_infop info) {
+    Decoder *dec = png_get_progressive_ptr(png);
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    int n = png_get_channels(png, info);
+    if (!decoder_alloc_pixels(dec, png_get_image_width(png, info), png_get_image_height(png, info), n)) {
+        png_error(png, "no room for pixels");
+    }
+}
+
+void decoder_png_row(png_structp png, png_bytep row, png_uint_32 row_num, int _pass) {
+    Decoder *dec = png_get_progressive_ptr(png);
+    if (row == NULL) return;
+    png_progressive_combine_row(png, dec->pixels + (size_t)row_num*dec->w*dec->n, row);
+}
+
+void decoder_png_end(png_structp png, png_infop _info) {
+    Decoder *dec = png_get_progressive_ptr(png);
+    dec->done = true;
+}
+
+bool decoder_feed_png(Decoder *dec, const unsigned char *data, size_t len) {
+    if (setjmp(png_jmpbuf(dec->png))) return false;
+    png_process_data(dec->png, dec->png_info, (png_bytep)data, len);
+    return true;
+}
+
+void decoder_jpeg_error(j_common_ptr cinfo) {
+    DecoderJpegError *err = (DecoderJpegError*)cinfo->err;
+    char message[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, message);
+    dprintf(2, "ERROR: JPEG decoding failed: %s\n", message);
+    longjmp(err->jmp, 1);
+}
+
+void decoder_jpeg_init_source(j_decompress_ptr _cinfo) {}
+void decoder_jpeg_term_source(j_decompress_ptr _cinfo) {}
+
+// Suspends decoding until more bytes are fed
+boolean decoder_jpeg_fill_input_buffer(j_decompress_ptr _cinfo) {
+    return FALSE;
+}
+
+void decoder_jpeg_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
+    Decoder *dec = (Decoder*)cinfo->client_data;
+    struct jpeg_source_mgr *src = cinfo->src;
+    if (num_bytes <= 0) return;
+    if ((size_t)num_bytes > src->bytes_in_buffer) {
+        dec->jpeg_skip += num_bytes - src->bytes_in_buffer;
+        src->next_input_byte += src->bytes_in_buffer;
+        src->bytes_in_buffer = 0;
+    } else {
+        src->next_input_byte += num_bytes;
+        src->bytes_in_buffer -= num_bytes;
+    }
+}
+
+// libjpeg can't turn CMYK into RGB, so those rows are converted here.
+// Adobe's encoders, which write most CMYK JPEGs, store them inverted.
+void decoder_jpeg_cmyk_row(unsigned char *rgb, const unsigned char *cmyk, int w, bool inverted) {
+    for (int x = 0; x < w; x++, rgb += 3, cmyk += 4) {
+        int k = inverted ? cmyk[3] : 255 - cmyk[3];
+        for (int i = 0; i < 3; i++) {
+            int c = inverted ? cmyk[i] : 255 - cmyk[i];
+            rgb[i] = (c*k + 127)/255;
+        }
+    }
+}
+
+// Runs libjpeg as far as the buffered input allows, resuming where the
+// last call suspended
+bool decoder_jpeg_step(Decoder *dec) {
+    struct jpeg_decompress_struct *cinfo = &dec->jpeg;
+    if (dec->jpeg_step == DECODER_JPEG_HEADER) {
+        if (jpeg_read_header(cinfo, TRUE) == JPEG_SUSPENDED) return true;
+        bool cmyk = cinfo->jpeg_color_space == JCS_CMYK || cinfo->jpeg_color_space == JCS_YCCK;
+        cinfo->out_color_space = cmyk ? JCS_CMYK : JCS_RGB;
+        cinfo->scale_num = 1;
+        cinfo->scale_denom = dec->scale;
+        jpeg_calc_output_dimensions(cinfo);
+        if (!decoder_alloc_pixels(dec, cinfo->output_width, cinfo->output_height, 3)) return false;
+        if (cmyk) dec->jpeg_cmyk = malloc((size_t)cinfo->output_width*4);
+        dec->jpeg_step = DECODER_JPEG_START;
+    }
+    if (dec->jpeg_step == DECODER_JPEG_START) {
+        if (!jpeg_start_decompress(cinfo)) return true;
+        dec->jpeg_step = DECODER_JPEG_SCANLINES;
+    }
+    if (dec->jpeg_step == DECODER_JPEG_SCANLINES) {
+        size_t stride = (size_t)dec->w*dec->n;
+        while (cinfo->output_scanline < cinfo->output_height) {
+            JSAMPROW out = dec->pixels + cinfo->output_scanline*stride;
+            JSAMPROW row = dec->jpeg_cmyk != NULL ? dec->jpeg_cmyk : out;
+            if (jpeg_read_scanlines(cinfo, &row, 1) == 0) return true;
+            if (dec->jpeg_cmyk != NULL) decoder_jpeg_cmyk_row(out, row, dec->w, cinfo->saw_Adobe_marker);
+        }
+        dec->jpeg_step = DECODER_JPEG_FINISH;
+    }
+    if (dec->jpeg_step == DECODER_JPEG_FINISH) {
+        if (!jpeg_finish_decompress(cinfo)) return true;
+        dec->done = true;
+    }
+    return true;
+}
+
+// libjpeg reads straight from `data` unless bytes from an earlier feed are
+// still waiting, and only what it did not consume gets copied for later
+bool decoder_feed_jpeg(Decoder *dec, const unsigned char *data, size_t len) {
+    struct jpeg_source_mgr *src = &dec->jpeg_src;
+    size_t skip = dec->jpeg_skip < len ? dec->jpeg_skip : len;
+    dec->jpeg_skip -= skip;
+    data += skip;
+    len -= skip;
+    size_t left = src->bytes_in_buffer;
+    if (left > 0) {
+        if (src->next_input_byte != dec->buf) memmove(dec->buf, src->next_input_byte, left);
+        dec->buf_len = left;
+        decoder_buf_append(dec, data, len);
+        src->next_input_byte = dec->buf;
+        src->bytes_in_buffer = dec->buf_len;
+    } else {
+        src->next_input_byte = data;
+        src->bytes_in_buffer = len;
+    }
+    if (setjmp(dec->jpeg_err.jmp)) return false;
+    if (!decoder_jpeg_step(dec)) return false;
+    if (left == 0 && src->bytes_in_buffer > 0 && !dec->done) {
+        dec->buf_len = 0;
+        decoder_buf_append(dec, src->next_input_byte, src->bytes_in_buffer);
+        src->next_input_byte = dec->buf;
+    }
+    return true;
+}
+
+// Decodes a complete AVIF. The dimensions are checked after parsing the
+// container, before the AV1 decoder allocates its planes.
+bool decoder_decode_avif(Decoder *dec, const unsigned char *data, size_t len) {
+    avifDecoder *avif = avifDecoderCreate();
+    if (avif == NULL) return false;
+    // Images are already decoded in parallel, one per decode thread
+    avif->maxThreads = 1;
+    if (dec->max_pixels < avif->imageSizeLimit) avif->imageSizeLimit = dec->max_pixels;
+    avifResult result = avifDecoderSetIOMemory(avif, data, len);
+    if (result == AVIF_RESULT_OK) result = avifDecoderParse(avif);
+    if (result != AVIF_RESULT_OK) {
+        dprintf(2, "ERROR: Bad AVIF header: %s\n", avifResultToString(result));
+        avifDecoderDestroy(avif);
+        return false;
+    }
+    int n = avif->alphaPresent ? 4 : 3;
+    if (!decoder_alloc_pixels(dec, avif->image->width, avif->image->height, n)) {
+        avifDecoderDestroy(avif);
+        return false;
+    }
+    result = avifDecoderNextImage(avif);
+    if (result == AVIF_RESULT_OK) {
+        avifRGBImage rgb;
+        avifRGBImageSetDefaults(&rgb, avif->image);
+        rgb.format = n == 4 ? AVIF_RGB_FORMAT_RGBA : AVIF_RGB_FORMAT_RGB;
+        rgb.depth = 8;
+        rgb.pixels = dec->pixels;
+        rgb.rowBytes = dec->w*n;
+        result = avifImageYUVToRGB(avif->image, &rgb);
+    }
+    avifDecoderDestroy(avif);
+    if (result != AVIF_RESULT_OK) {
+        dprintf(2, "ERROR: AVIF decoding failed: %s\n", avifResultToString(result));
+        return false;
+    }
+    dec->done = true;
+    return true;
+}
+
+// Bytes decoder_sniff needs to tell the formats apart
+#define DECODER_SNIFF_BYTES 12
+
+// Recognizes an image by its first bytes. Returns the extension of its
+// format, or NULL if there is no decoder for what the bytes look like.
+char *decoder_sniff(const char *data, size_t len) {
+    if (len >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) return "png";
+    if (len >= 3 && memcmp(data, "\xff\xd8\xff", 3) == 0) return "jpeg";
+    if (len >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data+8, "WEBP", 4) == 0) return "webp";
+    if (len >= 12 && memcmp(data+4, "ftyp", 4) == 0 && (memcmp(data+8, "avif", 4) == 0 || memcmp(data+8, "avis", 4) == 0)) {
+        return "avif";
+    }
+    return NULL;
+}
+
+uint32_t decoder_be(const unsigned char *bytes, int count) {
+    uint32_t value = 0;
+    for (int i = 0; i < count; i++) value = value << 8 | bytes[i];
+    return value;
+}
+
+// Reads the dimensions from the start of an image without decoding it, so
+// they can be checked before anything is allocated. Returns false if the
+// header is not complete yet or can't be parsed.
+bool decoder_info(const char *data, size_t len, char *ext, int *w, int *h) {
+    const unsigned char *bytes = (const unsigned char*)data;
+    if (strcmp(ext, "webp") == 0) {
+        return WebPGetInfo(bytes, len, w, h);
+    }
+    if (strcmp(ext, "png") == 0) {
+        if (len < 24 || memcmp(bytes+12, "IHDR", 4) != 0) return false;
+        *w = decoder_be(bytes+16, 4);
+        *h = decoder_be(bytes+20, 4);
+        return *w > 0 && *h > 0;
+    }
+    if (strcmp(ext, "jpeg") == 0 || strcmp(ext, "jpg") == 0) {
+        // Walk the markers up to the first start of frame
+        size_t i = 2;
+        while (i + 4 <= len) {
+            if (bytes[i] != 0xff) return false;
+            unsigned char marker = bytes[i+1];
+            if (marker == 0xff) {
+                i++;
+                continue;
+            }
+            if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+                i += 2;
+                continue;
+            }
+            bool sof = marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+            if (sof) {
+                if (i + 9 > len) return false;
+                *h = decoder_be(bytes+i+5, 2);
+                *w = decoder_be(bytes+i+7, 2);
+                return *w > 0 && *h > 0;
+            }
+            i += 2 + decoder_be(bytes+i+2, 2);
+        }
+    }
+    if (strcmp(ext, "avif") == 0) {
+        // Every image item has an ispe property with its dimensions. The
+        // primary image is the biggest one, its grid tiles and alpha plane
+        // are never bigger.
+        bool found = false;
+        for (size_t i = 4; i + 16 <= len; i++) {
+            if (memcmp(bytes+i, "ispe", 4) != 0) continue;
+            uint32_t ispe_w = decoder_be(bytes+i+8, 4);
+            uint32_t ispe_h = decoder_be(bytes+i+12, 4);
+            if (ispe_w == 0 || ispe_h == 0 || ispe_w > INT32_MAX || ispe_h > INT32_MAX) continue;
+            if (!found || (uint64_t)ispe_w*ispe_h > (uint64_t)(*w)*(*h)) {
+                *w = ispe_w;
+                *h = ispe_h;
+                found = true;
+            }
+        }
+        return found;
+    }
+    return false;
+}
+
+// Returns false for formats there is no decoder for. `pool` may be NULL.
+bool decoder_init(Decoder *dec, char *ext, size_t max_pixels, BufPool *pool) {
+    memset(dec, 0, sizeof(Decoder));
+    dec->max_pixels = max_pixels;
+    dec->pool = pool;
+    dec->scale = 1;
+    if (strcmp(ext, "webp") == 0) {
+        dec->kind = DECODER_WEBP;
+    } else if (strcmp(ext, "png") == 0) {
+        dec->kind = DECODER_PNG;
+        dec->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, decoder_png_error, NULL);
+        if (dec->png == NULL) return false;
+        dec->png_info = png_create_info_struct(dec->png);
+        if (dec->png_info == NULL) {
+            png_destroy_read_struct(&dec->png, NULL, NULL);
+            return false;
+        }
+        png_set_progressive_read_fn(dec->png, dec, decoder_png_info, decoder_png_row, decoder_png_end);
+    } else if (strcmp(ext, "jpeg") == 0 || strcmp(ext, "jpg") == 0) {
+        dec->kind = DECODER_JPEG;
+        dec->jpeg.err = jpeg_std_error(&dec->jpeg_err.pub);
+        dec->jpeg_err.pub.error_exit = decoder_jpeg_error;
+        jpeg_create_decompress(&dec->jpeg);
+        dec->jpeg.client_data = dec;
+        dec->jpeg_src.init_source = decoder_jpeg_init_source;
+        dec->jpeg_src.fill_input_buffer = decoder_jpeg_fill_input_buffer;
+        dec->jpeg_src.skip_input_data = decoder_jpeg_skip_input_data;
+        dec->jpeg_src.resync_to_restart = jpeg_resync_to_restart;
+        dec->jpeg_src.term_source = decoder_jpeg_term_source;
+        dec->jpeg.src = &dec->jpeg_src;
+    } else if (strcmp(ext, "avif") == 0) {
+        dec->kind = DECODER_AVIF;
+    } else {
+        dprintf(2, "ERROR: Don't know how to decode %s\n", ext);
+        return false;
+    }
+    return true;
+}
+
+// Returns false once the image is known to be broken or too big, after
+// which there is no point in feeding it more
+bool decoder_feed(Decoder *dec, const char *data, size_t len) {
+    if (dec->failed) return false;
+    if (dec->done || len == 0) return true;
+    bool ok;
+    switch (dec->kind) {
+        case DECODER_WEBP: ok = decoder_feed_webp(dec, (const unsigned char*)data, len); break;
+        case DECODER_PNG: ok = decoder_feed_png(dec, (const unsigned char*)data, len); break;
+        case DECODER_JPEG: ok = decoder_feed_jpeg(dec, (const unsigned char*)data, len); break;
+        case DECODER_AVIF: decoder_buf_append(dec, (const unsigned char*)data, len); ok = true; break;
+        default: ok = false;
+    }
+    if (!ok) dec->failed = true;
+    return ok;
+}
+
+// For consumers that only need a smaller image: JPEGs are then scaled down
+// by 2, 4 or 8 while libjpeg does the inverse DCT, which is much cheaper
+// than decoding at full size. Other formats are always decoded at full size.
+// Must be called before the first feed.
+bool decoder_set_scale(Decoder *dec, int scale) {
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        dprintf(2, "ERROR: Can't decode at 1/%d scale\n", scale);
+        return false;
+    }
+    dec->scale = scale;
+    return true;
+}
+
+// Decodes an image that is already complete in memory, writing the pixels
+// straight into the output buffer
+bool decoder_decode(Decoder *dec, const char *data, size_t len) {
+    if (dec->kind == DECODER_AVIF) {
+        if (!decoder_decode_avif(dec, (const unsigned char*)data, len)) dec->failed = true;
+        return !dec->failed;
+    }
+    if (dec->kind != DECODER_WEBP) return decoder_feed(dec, data, len) && dec->done;
+    WebPBitstreamFeatures features;
+    VP8StatusCode status = WebPGetFeatures((const uint8_t*)data, len, &features);
+    if (status != VP8_STATUS_OK) {
+        dprintf(2, "ERROR: Bad WebP header (status %d)\n", status);
+        dec->failed = true;
+        return false;
+    }
+    int n = features.has_alpha ? 4 : 3;
+    if (!decoder_alloc_pixels(dec, features.width, features.height, n)) {
+        dec->failed = true;
+        return false;
+    }
+    size_t size = (size_t)dec->w*dec->h*n;
+    uint8_t *out;
+    if (n == 4) out = WebPDecodeRGBAInto((const uint8_t*)data, len, dec->pixels, size, dec->w*n);
+    else out = WebPDecodeRGBInto((const uint8_t*)data, len, dec->pixels, size, dec->w*n);
+    if (out == NULL) {
+        dprintf(2, "ERROR: WebP decoding failed\n");
+        dec->failed = true;
+        return false;
+    }
+    dec->done = true;
+    return true;
+}
+
+// To be called after the last byte was fed. Returns true if the whole image
+// was decoded, leaving the caller to take over `pixels`.
+bool decoder_finish(Decoder *dec) {
+    if (dec->kind == DECODER_AVIF && !dec->failed && !dec->done) {
+        if (!decoder_decode_avif(dec, dec->buf, dec->buf_len)) dec->failed = true;
+    }
+    if (!dec->failed && !dec->done) dprintf(2, "ERROR: Image ended before it was fully decoded\n");
+    return !dec->failed && dec->done;
+}
+
+void decoder_free(Decoder *dec) {
+    if (dec->webp != NULL) WebPIDelete(dec->webp);
+    if (dec->png != NULL) png_destroy_read_struct(&dec->png, &dec->png_info, NULL);
+    if (dec->kind == DECODER_JPEG) jpeg_destroy_decompress(&dec->jpeg);
+    free(dec->buf);
+    free(dec->jpeg_cmyk);
+    if (dec->pixels != NULL && dec->pool != NULL) {
+        Buf buf = {.ptr = (char*)dec->pixels, .cap = dec->pixels_cap};
+        buf_pool_put(dec->pool, buf);
+    } else {
+        free(dec->pixels);
+    }
+    dec->buf = NULL;
+    dec->jpeg_cmyk = NULL;
+    dec->pixels = NULL;
+}
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <setjmp.h>
+
+#include "webp/encode.h"
+#include "jpeglib.h"
+#include "png.h"
+#include "avif.h"
+
+// Encoder contexts that live as long as the thread owning them. What the
+// libraries let us keep survives between images: the libjpeg compressor
+// with its tables, and the WebP config and planes. PNG and AVIF set up
+// fresh library state for each image, since their APIs have no way to
+// reset it.
+//
+// The lossy formats take the shared YUV planes from yuv.h, PNG takes the
+// RGB or RGBA pixels. Output goes into a Sink from sink.h: libjpeg through
+// a destination manager writing into the sink's window, libpng and libwebp
+// through write callbacks. Only libavif hands over its output in one piece
+// at the end.
+
+typedef struct {
+    int quality;
+    // libavif's speed (0-10), quality (0-100) and threads per image
+    int avif_speed;
+    int avif_quality;
+    int avif_threads;
+    // Tiles of 2^N x 2^N, 0 lets libavif choose
+    int avif_tile_log2;
+} EncoderSettings;
+
+typedef struct {
+    EncoderSettings settings;
+    // For callers to point their sinks at
+    char *buf;
+    size_t buf_cap;
+
+    struct jpeg_compress_struct jpeg;
+    struct jpeg_error_mgr jpeg_err;
+    struct jpeg_destination_mgr jpeg_dest;
+    // Where the image being compressed goes
+    Sink *jpeg_sink;
+
+    WebPConfig webp_config;
+    // Limited range copy of the planes, which libwebp may also modify
+    unsigned char *webp_planes;
+    size_t webp_planes_cap;
+} Encoder;
+
+void encoder_jpeg_window(j_compress_ptr cinfo) {
+    Sink *sink = ((Encoder*)cinfo->client_data)->jpeg_sink;
+    cinfo->dest->next_output_byte = (JOCTET*)sink->ptr + sink->len;
+    cinfo->dest->free_in_buffer = sink->cap - sink->len;
+}
+
+boolean encoder_jpeg_empty_output_buffer(j_compress_ptr cinfo) {
+    Sink *sink = ((Encoder*)cinfo->client_data)->jpeg_sink;
+    sink->len = sink->cap;
+    sink_flush(sink, 1);
+    encoder_jpeg_window(cinfo);
+    return TRUE;
+}
+
+void encoder_jpeg_term_destination(j_compress_ptr cinfo) {
+    Sink *sink = ((Encoder*)cinfo->client_data)->jpeg_sink;
+    sink->len = sink->cap - cinfo->dest->free_in_buffer;
+}
+
+bool encoder_init(Encoder *enc, size_t buf_cap, EncoderSettings *settings) {
+    memset(enc, 0, sizeof(Encoder));
+    enc->settings = *settings;
+    enc->buf = malloc(buf_cap);
+    if (enc->buf == NULL) return false;
+    enc->buf_cap = buf_cap;
+    enc->jpeg.err = jpeg_std_error(&enc->jpeg_err);
+    jpeg_create_compress(&enc->jpeg);
+    enc->jpeg.client_data = enc;
+    enc->jpeg_dest.init_destination = encoder_jpeg_window;
+    enc->jpeg_dest.empty_output_buffer = encoder_jpeg_empty_output_buffer;
+    enc->jpeg_dest.term_destination = encoder_jpeg_term_destination;
+    enc->jpeg.dest = &enc->jpeg_dest;
+    if (!WebPConfigPreset(&enc->webp_config, WEBP_PRESET_DEFAULT, settings->quality)) {
+        dprintf(2, "ERROR: Could not set up webp config\n");
+        return false;
+    }
+    return true;
+}
+
+void encoder_png_error(png_structp png, png_const_charp message) {
+    dprintf(2, "ERROR: png encoding failed: %s\n", message);
+    png_longjmp(png, 1);
+}
+
+void encoder_png_write(png_structp png, png_bytep data, size_t size) {
+    if (!sink_write((Sink*)png_get_io_ptr(png), data, size)) png_error(png, "sink failed");
+}
+
+void encoder_png_flush(png_structp _png) {}
+
+bool encoder_png(Encoder *enc, const unsigned char *pixels, int w, int h, int n, Sink *out) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, encoder_png_error, NULL);
+    if (png == NULL) return false;
+    png_infop info = png_create_info_struct(png);
+    if (info == NULL) {
+        png_destroy_write_struct(&png, NULL);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+    png_set_write_fn(png, out, encoder_png_write, encoder_png_flush);
+    png_set_IHDR(png, info, w, h, 8, n == 4 ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_sRGB(png, info, PNG_sRGB_INTENT_PERCEPTUAL);
+    png_write_info(png, info);
+    for (int y = 0; y < h; y++) png_write_row(png, pixels + (size_t)y*w*n);
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+    return true;
+}
+
+// libjpeg takes the planes as raw data
+bool encoder_jpeg(Encoder *enc, const Yuv420 *yuv, Sink *out) {
+    struct jpeg_compress_struct *cinfo = &enc->jpeg;
+    cinfo->image_width = yuv->w;
+    cinfo->image_height = yuv->h;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_YCbCr;
+    enc->jpeg_sink = out;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, enc->settings.quality, TRUE);
+    // The defaults already sample chroma at 2x2, so the shared planes go in
+    // as they are, 16 luma rows per iMCU row
+    cinfo->raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    cinfo->do_fancy_downsampling = FALSE;
+#endif
+    jpeg_start_compress(cinfo, TRUE);
+    JSAMPROW y_rows[16], u_rows[8], v_rows[8];
+    JSAMPARRAY planes[3] = {y_rows, u_rows, v_rows};
+    while (cinfo->next_scanline < cinfo->image_height) {
+        for (int i = 0; i < 16; i++) y_rows[i] = yuv->y + (size_t)(cinfo->next_scanline + i)*yuv->y_stride;
+        for (int i = 0; i < 8; i++) {
+            u_rows[i] = yuv->u + (size_t)(cinfo->next_scanline/2 + i)*yuv->uv_stride;
+            v_rows[i] = yuv->v + (size_t)(cinfo->next_scanline/2 + i)*yuv->uv_stride;
+        }
+        jpeg_write_raw_data(cinfo, planes, 16);
+    }
+    jpeg_finish_compress(cinfo);
+    enc->jpeg_sink = NULL;
+    return !out->failed;
+}
+
+int encoder_webp_write(const uint8_t *data, size_t size, const WebPPicture *pic) {
+    return sink_write((Sink*)pic->custom_ptr, data, size);
+}
+
+bool encoder_webp(Encoder *enc, const Yuv420 *yuv, Sink *out) {
+    WebPPicture pic;
+    WebPPictureInit(&pic);
+    pic.width = yuv->w;
+    pic.height = yuv->h;
+    pic.use_argb = 0;
+    pic.colorspace = yuv->a != NULL ? WEBP_YUV420A : WEBP_YUV420;
+    // The picture is a view of our planes, so libwebp allocates none
+    pic.y_stride = yuv->w;
+    pic.uv_stride = (yuv->w + 1)/2;
+    size_t y_size = (size_t)pic.y_stride*yuv->h;
+    size_t uv_size = (size_t)pic.uv_stride*((yuv->h + 1)/2);
+    size_t size = y_size + 2*uv_size + (yuv->a != NULL ? y_size : 0);
+    if (size > enc->webp_planes_cap) {
+        free(enc->webp_planes);
+        enc->webp_planes = malloc(size);
+        enc->webp_planes_cap = enc->webp_planes ? size : 0;
+        if (enc->webp_planes == NULL) return false;
+    }
+    pic.y = enc->webp_planes;
+    pic.u = pic.y + y_size;
+    pic.v = pic.u + uv_size;
+    yuv420_to_limited(yuv, pic.y, pic.y_stride, pic.u, pic.v, pic.uv_stride);
+    if (yuv->a != NULL) {
+        pic.a = pic.v + uv_size;
+        pic.a_stride = yuv->w;
+        for (int y = 0; y < yuv->h; y++) {
+            memcpy(pic.a + (size_t)y*pic.a_stride, yuv->a + (size_t)y*yuv->y_stride, yuv->w);
+        }
+    }
+    pic.writer = encoder_webp_write;
+    pic.custom_ptr = out;
+    if (!WebPEncode(&enc->webp_config, &pic)) {
+        dprintf(2, "ERROR: webp encoding failed with code %d\n", pic.error_code);
+        return false;
+    }
+    return true;
+}
+
+bool encoder_avif(Encoder *enc, const Yuv420 *yuv, Sink *out) {
+    avifImage *image = avifImageCreate(yuv->w, yuv->h, 8, AVIF_PIXEL_FORMAT_YUV420);
+    if (image == NULL) {
+        dprintf(2, "ERROR: Could not create avif image\n");
+        return false;
+    }
+    // The image only points at the shared planes
+    image->yuvRange = AVIF_RANGE_FULL;
+    image->matrixCoefficients = AVIF_MATRIX_COEFFICIENTS_BT601;
+    image->yuvPlanes[AVIF_CHAN_Y] = yuv->y;
+    image->yuvPlanes[AVIF_CHAN_U] = yuv->u;
+    image->yuvPlanes[AVIF_CHAN_V] = yuv->v;
+    image->yuvRowBytes[AVIF_CHAN_Y] = yuv->y_stride;
+    image->yuvRowBytes[AVIF_CHAN_U] = yuv->uv_stride;
+    image->yuvRowBytes[AVIF_CHAN_V] = yuv->uv_stride;
+    image->imageOwnsYUVPlanes = AVIF_FALSE;
+    if (yuv->a != NULL) {
+        image->alphaPlane = yuv->a;
+        image->alphaRowBytes = yuv->y_stride;
+        image->imageOwnsAlphaPlane = AVIF_FALSE;
+    }
+
+    // libavif encoders hold on to the images they were given, so each image
+    // needs a new one
+    avifEncoder *encoder = avifEncoderCreate();
+    if (encoder == NULL) {
+        dprintf(2, "ERROR: Could not create avif encoder\n");
+        avifImageDestroy(image);
+        return false;
+    }
+    EncoderSettings *settings = &enc->settings;
+    encoder->speed = settings->avif_speed;
+    encoder->quality = settings->avif_quality;
+    encoder->qualityAlpha = settings->avif_quality;
+    encoder->maxThreads = settings->avif_threads > 0 ? settings->avif_threads : 1;
+    if (settings->avif_tile_log2 > 0) {
+        encoder->tileRowsLog2 = settings->avif_tile_log2;
+        encoder->tileColsLog2 = settings->avif_tile_log2;
+    } else {
+        encoder->autoTiling = AVIF_TRUE;
+    }
+    avifRWData output = AVIF_DATA_EMPTY;
+    avifResult result = avifEncoderWrite(encoder, image, &output);
+    bool ok = result == AVIF_RESULT_OK;
+    if (ok) ok = sink_write(out, output.data, output.size);
+    else dprintf(2, "ERROR: avif encoding failed: %s\n", avifResultToString(result));
+    avifRWDataFree(&output);
+    avifEncoderDestroy(encoder);
+    avifImageDestroy(image);
+    return ok;
+}
+
+// Encodes into `format`, writing to `out`. The caller finishes the sink.
+bool encoder_encode(Encoder *enc, char *format, const unsigned char *pixels, int w, int h, int n, const Yuv420 *yuv, Sink *out) {
+    if (strcmp(format, "png") == 0) return encoder_png(enc, pixels, w, h, n, out);
+    if (strcmp(format, "jpeg") == 0) return encoder_jpeg(enc, yuv, out);
+    if (strcmp(format, "webp") == 0) return encoder_webp(enc, yuv, out);
+    if (strcmp(format, "avif") == 0) return encoder_avif(enc, yuv, out);
+    dprintf(2, "ERROR: Don't know how to encode %s\n", format);
+    return false;
+}
+
+void encoder_free(Encoder *enc) {
+    jpeg_destroy_compress(&enc->jpeg);
+    free(enc->webp_planes);
+    free(enc->buf);
+}
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#define FETCH_POLL_MS 1000
+// Bodies without Content-Length start this small and double as they grow
+#define FETCH_BODY_INITIAL 64*1024
+// Idle buffers beyond this many bytes are freed instead of kept for reuse
+#define FETCH_POOL_MAX_BYTES 64*1024*1024
+// The `max` of bodies that may grow as big as memory allows
+#define FETCH_BODY_UNLIMITED ((size_t)-2)
+
+typedef struct Fetcher Fetcher;
+
+// Called as soon as a transfer finishes, with the pointer set as the easy
+// handle's CURLOPT_PRIVATE. The callback owns the easy handle and may
+// add more transfers. So may the write callbacks of running transfers,
+// theirs wait until curl returns.
+typedef void (*FetchDone)(Fetcher *fetcher, CURL *easy, CURLcode result, void *data);
+
+typedef struct {
+    size_t transfers;
+    // Transfers that went over a connection which was already open
+    size_t reused;
+    size_t new_connections;
+    size_t http2;
+} FetchStats;
+
+// Runs transfers on one curl multi handle, keeping at most `max_active` in
+// flight. A new transfer starts whenever one finishes, so a slow download
+// only holds its own slot.
+//
+// A fetcher is meant to live as long as its thread: the multi handle keeps
+// connections open between runs, and finished easy handles are kept for
+// the next transfers instead of being cleaned up.
+struct Fetcher {
+    CURLM *multi;
+    size_t max_active;
+    size_t active;
+    FetchDone done;
+    void *ctx;
+    FetchStats stats;
+    // Set while curl runs transfers, when it refuses to take more
+    bool performing;
+
+    CURL **pending;
+    size_t pending_head;
+    size_t pending_len;
+    size_t pending_cap;
+
+    CURL **idle;
+    size_t idle_len;
+    size_t idle_cap;
+
+    // Download buffers that finished transfers gave back. Bodies may be
+    // released from other threads once their transfer is done.
+    BufPool bufs;
+};
+
+// Where a transfer's body goes. Starts empty, is sized from Content-Length
+// when the server sends it, and the transfer is aborted once it would
+// grow past `max`. The content is always NUL-terminated.
+typedef struct {
+    Fetcher *fetcher;
+    CURL *easy;
+    char *ptr;
+    size_t len;
+    size_t cap;
+    size_t max;
+    bool too_big;
+} FetchBody;
+
+// DNS answers and TLS sessions are shared by every fetcher in the process.
+// Connections stay per fetcher, since curl does not support using one
+// connection cache from several threads at once.
+static CURLSH *fetch_share;
+static pthread_mutex_t fetch_share_locks[CURL_LOCK_DATA_LAST];
+
+void fetch_share_lock(CURL *_easy, curl_lock_data data, curl_lock_access _access, void *_ctx) {
+    pthread_mutex_lock(&fetch_share_locks[data]);
+}
+
+void fetch_share_unlock(CURL *_easy, curl_lock_data data, void *_ctx) {
+    pthread_mutex_unlock(&fetch_share_locks[data]);
+}
+
+// Must be called once before any thread creates a fetcher
+bool fetch_global_init() {
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+        dprintf(2, "ERROR: Could not init curl\n");
+        return false;
+    }
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_init(&fetch_share_locks[i], NULL);
+    fetch_share = curl_share_init();
+    if (fetch_share == NULL) {
+        dprintf(2, "ERROR: Could not create curl share\n");
+        return false;
+    }
+    curl_share_setopt(fetch_share, CURLSHOPT_LOCKFUNC, fetch_share_lock);
+    curl_share_setopt(fetch_share, CURLSHOPT_UNLOCKFUNC, fetch_share_unlock);
+    curl_share_setopt(fetch_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(fetch_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    return true;
+}
+
+bool fetcher_init(Fetcher *fetcher, size_t max_active) {
+    memset(fetcher, 0, sizeof(Fetcher));
+    fetcher->multi = curl_multi_init();
+    if (fetcher->multi == NULL) {
+        dprintf(2, "ERROR: Could not create curl multi handle\n");
+        return false;
+    }
+    // Same-origin images share one HTTP/2 connection instead of opening one each
+    curl_multi_setopt(fetcher->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    fetcher->max_active = max_active;
+    buf_pool_init(&fetcher->bufs, FETCH_POOL_MAX_BYTES);
+    return true;
+}
+
+// Returns an easy handle with default options plus the shared caches, reusing
+// one released earlier when possible
+CURL *fetcher_easy(Fetcher *fetcher) {
+    CURL *easy;
+    if (fetcher->idle_len > 0) {
+        easy = fetcher->idle[--fetcher->idle_len];
+    } else {
+        easy = curl_easy_init();
+    }
+    curl_easy_setopt(easy, CURLOPT_SHARE, fetch_share);
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    // Wait for a connection that can multiplex rather than opening another one
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+    return easy;
+}
+
+void fetcher_release(Fetcher *fetcher, CURL *easy) {
+    curl_easy_reset(easy);
+    if (fetcher->idle_len == fetcher->idle_cap) {
+        fetcher->idle_cap = fetcher->idle_cap ? fetcher->idle_cap*2 : 16;
+        fetcher->idle = realloc(fetcher->idle, fetcher->idle_cap*sizeof(CURL*));
+    }
+    fetcher->idle[fetcher->idle_len++] = easy;
+}
+
+void fetch_body_init(FetchBody *body, Fetcher *fetcher, CURL *easy, size_t max) {
+    memset(body, 0, sizeof(FetchBody));
+    body->fetcher = fetcher;
+    body->easy = easy;
+    body->max = max;
+}
+
+// Makes room for `size` bytes plus the NUL terminator, false if that is
+// more than the body may hold
+bool fetch_body_reserve(FetchBody *body, size_t size) {
+    if (size + 1 <= body->cap) return true;
+    if (size > body->max) return false;
+    size_t cap = body->cap ? body->cap : FETCH_BODY_INITIAL;
+    while (cap < size + 1) cap *= 2;
+    if (cap > body->max + 1) cap = body->max + 1;
+    Buf buf = buf_pool_get(&body->fetcher->bufs, cap);
+    if (buf.ptr == NULL) return false;
+    if (body->len > 0) memcpy(buf.ptr, body->ptr, body->len);
+    Buf old = {.ptr = body->ptr, .cap = body->cap};
+    buf_pool_put(&body->fetcher->bufs, old);
+    body->ptr = buf.ptr;
+    body->cap = buf.cap;
+    return true;
+}
+
+// CURLOPT_WRITEFUNCTION for a FetchBody
+size_t fetch_body_write(char *chunk, size_t _one, size_t chunk_size, FetchBody *body) {
+    if (body->cap == 0) {
+        curl_off_t content_length = -1;
+        curl_easy_getinfo(body->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+        if (content_length > 0 && (size_t)content_length > body->max) {
+            body->too_big = true;
+            return 0;
+        }
+        if (content_length > 0 && !fetch_body_reserve(body, content_length)) return 0;
+    }
+    if (body->len + chunk_size > body->max) {
+        body->too_big = true;
+        return 0;
+    }
+    if (!fetch_body_reserve(body, body->len + chunk_size)) return 0;
+    memcpy(body->ptr + body->len, chunk, chunk_size);
+    body->len += chunk_size;
+    body->ptr[body->len] = '\0';
+    return chunk_size;
+}
+
+// Gives the buffer back to the fetcher's pool
+void fetch_body_release(FetchBody *body) {
+    Buf buf = {.ptr = body->ptr, .cap = body->cap};
+    buf_pool_put(&body->fetcher->bufs, buf);
+    body->ptr = NULL;
+    body->len = 0;
+    body->cap = 0;
+}
+
+void fetcher_count(Fetcher *fetcher, CURL *easy) {
+    long connects = 0;
+    long version = 0;
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(easy, CURLINFO_HTTP_VERSION, &version);
+    fetcher->stats.transfers++;
+    fetcher->stats.new_connections += connects;
+    if (connects == 0) fetcher->stats.reused++;
+    if (version == CURL_HTTP_VERSION_2_0) fetcher->stats.http2++;
+}
+
+void fetcher_start(Fetcher *fetcher, CURL *easy) {
+    CURLMcode res = curl_multi_add_handle(fetcher->multi, easy);
+    if (res != CURLM_OK) {
+        dprintf(2, "ERROR: Could not start transfer: %s\n", curl_multi_strerror(res));
+        void *data;
+        curl_easy_getinfo(easy, CURLINFO_PRIVATE, &data);
+        fetcher->done(fetcher, easy, CURLE_FAILED_INIT, data);
+        return;
+    }
+    fetcher->active++;
+}
+
+// Starts pending transfers while there are free slots
+void fetcher_fill(Fetcher *fetcher) {
+    while (fetcher->active < fetcher->max_active && fetcher->pending_len > 0) {
+        CURL *easy = fetcher->pending[fetcher->pending_head];
+        fetcher->pending_head = (fetcher->pending_head + 1) % fetcher->pending_cap;
+        fetcher->pending_len--;
+        fetcher_start(fetcher, easy);
+    }
+}
+
+void fetcher_add(Fetcher *fetcher, CURL *easy) {
+    if (fetcher->active < fetcher->max_active && !fetcher->performing) {
+        fetcher_start(fetcher, easy);
+        return;
+    }
+    if (fetcher->pending_len == fetcher->pending_cap) {
+        size_t cap = fetcher->pending_cap ? fetcher->pending_cap*2 : 16;
+        CURL **pending = malloc(cap*sizeof(CURL*));
+        for (size_t i = 0; i < fetcher->pending_len; i++) {
+            pending[i] = fetcher->pending[(fetcher->pending_head + i) % fetcher->pending_cap];
+        }
+        free(fetcher->pending);
+        fetcher->pending = pending;
+        fetcher->pending_head = 0;
+        fetcher->pending_cap = cap;
+    }
+    fetcher->pending[(fetcher->pending_head + fetcher->pending_len) % fetcher->pending_cap] = easy;
+    fetcher->pending_len++;
+}
+
+// Drives transfers until none are active or pending
+void fetcher_run(Fetcher *fetcher) {
+    while (fetcher->active > 0 || fetcher->pending_len > 0) {
+        fetcher_fill(fetcher);
+        int running;
+        fetcher->performing = true;
+        curl_multi_perform(fetcher->multi, &running);
+        fetcher->performing = false;
+        fetcher_fill(fetcher);
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(fetcher->multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            CURL *easy = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(fetcher->multi, easy);
+            fetcher->active--;
+            fetcher_count(fetcher, easy);
+            void *data;
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, &data);
+            fetcher->done(fetcher, easy, result, data);
+            fetcher_fill(fetcher);
+        }
+        if (fetcher->active > 0) curl_multi_poll(fetcher->multi, NULL, 0, FETCH_POLL_MS, NULL);
+    }
+}
+
+void fetcher_perform_done(Fetcher *_fetcher, CURL *_easy, CURLcode result, void *data) {
+    *(CURLcode*)data = result;
+}
+
+// Runs a single transfer to completion over the fetcher's connections. Only
+// for when nothing else is running on the fetcher.
+CURLcode fetcher_perform(Fetcher *fetcher, CURL *easy) {
+    CURLcode result = CURLE_OK;
+    FetchDone done = fetcher->done;
+    fetcher->done = fetcher_perform_done;
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, &result);
+    fetcher_add(fetcher, easy);
+    fetcher_run(fetcher);
+    fetcher->done = done;
+    return result;
+}
+
+void fetcher_free(Fetcher *fetcher) {
+    for (size_t i = 0; i < fetcher->idle_len; i++) curl_easy_cleanup(fetcher->idle[i]);
+    curl_multi_cleanup(fetcher->multi);
+    free(fetcher->idle);
+    free(fetcher->pending);
+    buf_pool_free(&fetcher->bufs);
+}
@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Finds the images a page refers to in one pass over its HTML. memchr,
+// which libc vectorizes, jumps from tag to tag, over quoted attribute
+// values and through the content of <script> and the like, so only tag
+// and attribute names are looked at a byte at a time.
+//
+// Images come from the src and srcset of <img>, from the srcset of
+// <source> in <picture>, from the attributes lazy loading scripts move
+// them to, and from url() in the style attribute of any element. Each
+// candidate of a srcset is reported on its own, with its descriptor.
+// Stylesheets of <link rel=stylesheet> are reported the same way, and the
+// content of <style> elements is handed over as it is, for css.h.
+//
+// A page can be scanned as it arrives: tags cut off at the end of what
+// has arrived are left for the next call, so each image is reported once.
+
+typedef enum {
+    // A single URL
+    HTML_URL,
+    // Comma separated URLs with width or density descriptors
+    HTML_SRCSET,
+    // CSS declarations with url()
+    HTML_STYLE,
+    // Link types of <link>
+    HTML_REL,
+} HtmlAttrKind;
+
+typedef struct {
+    char *name;
+    size_t len;
+    HtmlAttrKind kind;
+} HtmlAttr;
+
+#define HTML_ATTR(name, kind) {name, sizeof(name) - 1, kind}
+
+static HtmlAttr html_img_attrs[] = {
+    HTML_ATTR("src", HTML_URL),
+    HTML_ATTR("srcset", HTML_SRCSET),
+    HTML_ATTR("data-src", HTML_URL),
+    HTML_ATTR("data-srcset", HTML_SRCSET),
+    HTML_ATTR("data-lazy-src", HTML_URL),
+    HTML_ATTR("data-lazy-srcset", HTML_SRCSET),
+    HTML_ATTR("style", HTML_STYLE),
+};
+
+static HtmlAttr html_source_attrs[] = {
+    HTML_ATTR("srcset", HTML_SRCSET),
+    HTML_ATTR("data-srcset", HTML_SRCSET),
+    HTML_ATTR("data-lazy-srcset", HTML_SRCSET),
+};
+
+static HtmlAttr html_link_attrs[] = {
+    HTML_ATTR("href", HTML_URL),
+    HTML_ATTR("rel", HTML_REL),
+};
+
+static HtmlAttr html_any_attrs[] = {
+    HTML_ATTR("style", HTML_STYLE),
+};
+
+// Elements whose content is text, not markup
+static char *html_raw_text[] = {"script", "style", "textarea", "title"};
+
+// Attributes with images one tag can have at most, more are ignored
+#define HTML_TAG_ATTRS 8
+#define HTML_TAG_LEN 16
+
+typedef struct {
+    // The URL as it is in the page, character references included. Points
+    // into the page, so the caller may overwrite it.
+    char *url;
+    size_t url_len;
+    // "640w" or "2x" for srcset candidates that have one, else empty
+    char *descriptor;
+    size_t descriptor_len;
+    // Where it was found
+    char tag[HTML_TAG_LEN];
+    char *attr;
+    // The URL is of a stylesheet, not an image
+    bool stylesheet;
+} HtmlImage;
+
+typedef struct HtmlScanner HtmlScanner;
+
+struct HtmlScanner {
+    void (*found)(HtmlImage *image, void *ctx);
+    // Gets the content of each <style> element, may be NULL
+    void (*style)(char *css, size_t len, void *ctx);
+    void *ctx;
+    // Where the next call starts
+    size_t pos;
+    // The raw text element we are in, empty outside of them, and where its
+    // content starts
+    char raw_text[HTML_TAG_LEN];
+    size_t raw_start;
+    size_t images;
+};
+
+void html_scanner_init(HtmlScanner *scanner, void (*found)(HtmlImage *image, void *ctx), void (*style)(char *css, size_t len, void *ctx), void *ctx) {
+    memset(scanner, 0, sizeof(HtmlScanner));
+    scanner->found = found;
+    scanner->style = style;
+    scanner->ctx = ctx;
+}
+
+#define HTML_SPACE 1
+// Ends tag and attribute names
+#define HTML_NAME_END 2
+
+static const unsigned char html_chars[256] = {
+    [' '] = HTML_SPACE | HTML_NAME_END, ['\n'] = HTML_SPACE | HTML_NAME_END, ['\t'] = HTML_SPACE | HTML_NAME_END,
+    ['\r'] = HTML_SPACE | HTML_NAME_END, ['\f'] = HTML_SPACE | HTML_NAME_END,
+    ['/'] = HTML_NAME_END, ['>'] = HTML_NAME_END, ['='] = HTML_NAME_END,
+};
+
+static inline bool html_space(char c) {
+    return html_chars[(unsigned char)c] & HTML_SPACE;
+}
+
+static inline bool html_name_end(char c) {
+    return html_chars[(unsigned char)c] & HTML_NAME_END;
+}
+
+void html_emit(HtmlScanner *scanner, HtmlImage *image, char *url, size_t url_len, char *descriptor, size_t descriptor_len) {
+    while (url_len > 0 && html_space(*url)) url++, url_len--;
+    while (url_len > 0 && html_space(url[url_len - 1])) url_len--;
+    if (url_len == 0) return;
+    image->url = url;
+    image->url_len = url_len;
+    image->descriptor = descriptor;
+    image->descriptor_len = descriptor_len;
+    scanner->images++;
+    scanner->found(image, scanner->ctx);
+}
+
+// Candidates are split at whitespace, not commas, so data: URIs stay whole
+void html_emit_srcset(HtmlScanner *scanner, HtmlImage *image, char *p, char *end) {
+    while (p < end) {
+        while (p < end && (html_space(*p) || *p == ',')) p++;
+        char *url = p;
+        while (p < end && !html_space(*p)) p++;
+        char *url_end = p;
+        if (url_end > url && url_end[-1] == ',') {
+            while (url_end > url && url_end[-1] == ',') url_end--;
+            html_emit(scanner, image, url, url_end - url, p, 0);
+            continue;
+        }
+        while (p < end && html_space(*p)) p++;
+        char *descriptor = p;
+        char *comma = memchr(p, ',', end - p);
+        p = comma != NULL ? comma : end;
+        char *descriptor_end = p;
+        while (descriptor_end > descriptor && html_space(descriptor_end[-1])) descriptor_end--;
+        html_emit(scanner, image, url, url_end - url, descriptor, descriptor_end - descriptor);
+    }
+}
+
+// Reports the url() of CSS declarations, quoted or not. Inside a double
+// quoted attribute the quotes are often written as &quot;.
+void html_emit_style(HtmlScanner *scanner, HtmlImage *image, char *start, char *end) {
+    char *p = start;
+    while (p < end) {
+        char *paren = memchr(p, '(', end - p);
+        if (paren == NULL) return;
+        p = paren + 1;
+        if (paren - start < 3 || strncasecmp(paren - 3, "url", 3) != 0) continue;
+        while (p < end && html_space(*p)) p++;
+        char *close = ")";
+        if (p < end && (*p == '"' || *p == '\'')) {
+            close = *p == '"' ? "\"" : "'";
+            p++;
+        } else if (end - p >= 6 && strncmp(p, "&quot;", 6) == 0) {
+            close = "&quot;";
+            p += 6;
+        }
+        char *url = p;
+        p = memmem(url, end - url, close, strlen(close));
+        if (p == NULL) p = end;
+        html_emit(scanner, image, url, p - url, p, 0);
+    }
+}
+
+// Whether the link types have "stylesheet" and not "alternate"
+bool html_rel_stylesheet(char *p, char *end) {
+    bool stylesheet = false;
+    while (p < end) {
+        while (p < end && html_space(*p)) p++;
+        char *type = p;
+        while (p < end && !html_space(*p)) p++;
+        if (p - type == 10 && strncasecmp(type, "stylesheet", 10) == 0) stylesheet = true;
+        if (p - type == 9 && strncasecmp(type, "alternate", 9) == 0) return false;
+    }
+    return stylesheet;
+}
+
+// Parses the tag at `page[start]`, which is '<'. Returns where the tag
+// ends, or 0 if it goes on past `len`.
+size_t html_tag(HtmlScanner *scanner, char *page, size_t start, size_t len, bool complete) {
+    char *p = page + start + 1;
+    char *end = page + len;
+    if (p < end && *p == '!') {
+        if (end - p >= 3 && strncmp(p, "!--", 3) == 0) {
+            char *close = memmem(p + 3, end - p - 3, "-->", 3);
+            if (close != NULL) return close + 3 - page;
+            return complete ? len : 0;
+        }
+    }
+    if (p < end && (*p == '!' || *p == '?' || *p == '/')) {
+        char *close = memchr(p, '>', end - p);
+        if (close != NULL) return close + 1 - page;
+        return complete ? len : 0;
+    }
+
+    char tag[HTML_TAG_LEN];
+    size_t tag_len = 0;
+    while (p < end && !html_name_end(*p)) {
+        if (tag_len < HTML_TAG_LEN - 1) tag[tag_len++] = *p | 0x20;
+        p++;
+    }
+    tag[tag_len] = '\0';
+    // A '<' that doesn't start a tag is text
+    if (tag_len == 0 || (tag[0] < 'a' || tag[0] > 'z')) return p < end || complete ? start + 1 : 0;
+
+    HtmlAttr *attrs = html_any_attrs;
+    size_t attrs_len = sizeof(html_any_attrs)/sizeof(html_any_attrs[0]);
+    if (strcmp(tag, "img") == 0) {
+        attrs = html_img_attrs;
+        attrs_len = sizeof(html_img_attrs)/sizeof(html_img_attrs[0]);
+    } else if (strcmp(tag, "source") == 0) {
+        attrs = html_source_attrs;
+        attrs_len = sizeof(html_source_attrs)/sizeof(html_source_attrs[0]);
+    } else if (strcmp(tag, "link") == 0) {
+        attrs = html_link_attrs;
+        attrs_len = sizeof(html_link_attrs)/sizeof(html_link_attrs[0]);
+    }
+
+    // Values are only looked at once the whole tag is there
+    HtmlAttr *found[HTML_TAG_ATTRS];
+    char *values[HTML_TAG_ATTRS];
+    char *values_end[HTML_TAG_ATTRS];
+    size_t found_len = 0;
+    for (;;) {
+        while (p < end && (html_space(*p) || *p == '/')) p++;
+        if (p == end) return complete ? len : 0;
+        if (*p == '>') break;
+        char *name = p;
+        while (p < end && !html_name_end(*p)) p++;
+        size_t name_len = p - name;
+        while (p < end && html_space(*p)) p++;
+        char *value = p;
+        char *value_end = p;
+        if (p < end && *p == '=') {
+            p++;
+            while (p < end && html_space(*p)) p++;
+            if (p < end && (*p == '"' || *p == '\'')) {
+                char *close = memchr(p + 1, *p, end - p - 1);
+                if (close == NULL) return complete ? len : 0;
+                value = p + 1;
+                value_end = close;
+                p = close + 1;
+            } else {
+                value = p;
+                while (p < end && !html_space(*p) && *p != '>') p++;
+                value_end = p;
+            }
+        }
+        for (size_t i = 0; i < attrs_len && found_len < HTML_TAG_ATTRS; i++) {
+            if (attrs[i].len == name_len && strncasecmp(attrs[i].name, name, name_len) == 0) {
+                found[found_len] = &attrs[i];
+                values[found_len] = value;
+                values_end[found_len] = value_end;
+                found_len++;
+                break;
+            }
+        }
+    }
+
+    HtmlImage image;
+    memcpy(image.tag, tag, tag_len + 1);
+    // The href of a <link> only counts if it is a stylesheet that applies
+    image.stylesheet = false;
+    bool link = attrs == html_link_attrs;
+    for (size_t i = 0; i < found_len; i++) {
+        if (found[i]->kind == HTML_REL) image.stylesheet = html_rel_stylesheet(values[i], values_end[i]);
+    }
+    for (size_t i = 0; i < found_len && (!link || image.stylesheet); i++) {
+        image.attr = found[i]->name;
+        switch (found[i]->kind) {
+        case HTML_URL:
+            html_emit(scanner, &image, values[i], values_end[i] - values[i], values_end[i], 0);
+            break;
+        case HTML_SRCSET:
+            html_emit_srcset(scanner, &image, values[i], values_end[i]);
+            break;
+        case HTML_STYLE:
+            html_emit_style(scanner, &image, values[i], values_end[i]);
+            break;
+        case HTML_REL:
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(html_raw_text)/sizeof(html_raw_text[0]); i++) {
+        if (strcmp(tag, html_raw_text[i]) == 0) {
+            strcpy(scanner->raw_text, tag);
+            scanner->raw_start = p + 1 - page;
+        }
+    }
+    return p + 1 - page;
+}
+
+// Skips to the tag closing the raw text element. Returns where that tag
+// starts, or 0 if it hasn't arrived.
+size_t html_raw_text_end(HtmlScanner *scanner, char *page, size_t len, bool complete) {
+    size_t tag_len = strlen(scanner->raw_text);
+    char *p = page + scanner->pos;
+    char *end = page + len;
+    for (;;) {
+        char *lt = memchr(p, '<', end - p);
+        if (lt == NULL) {
+            if (complete) return len;
+            scanner->pos = len;
+            return 0;
+        }
+        if ((size_t)(end - lt) < tag_len + 2) {
+            if (complete) return len;
+            scanner->pos = lt - page;
+            return 0;
+        }
+        if (lt[1] == '/' && strncasecmp(lt + 2, scanner->raw_text, tag_len) == 0) return lt - page;
+        p = lt + 1;
+    }
+}
+
+// Scans `page` from where the last call stopped up to `len`. `complete`
+// tells there is no more to come, otherwise a tag cut off at `len` waits
+// for the next call. Returns how far it got.
+size_t html_scan(HtmlScanner *scanner, char *page, size_t len, bool complete) {
+    while (scanner->pos < len) {
+        if (scanner->raw_text[0] != '\0') {
+            size_t close = html_raw_text_end(scanner, page, len, complete);
+            if (close == 0) return scanner->pos;
+            if (scanner->style != NULL && strcmp(scanner->raw_text, "style") == 0) {
+                scanner->style(page + scanner->raw_start, close - scanner->raw_start, scanner->ctx);
+            }
+            scanner->pos = close;
+            scanner->raw_text[0] = '\0';
+            if (close == len) break;
+        }
+        char *lt = memchr(page + scanner->pos, '<', len - scanner->pos);
+        if (lt == NULL) {
+            scanner->pos = len;
+            break;
+        }
+        size_t tag_end = html_tag(scanner, page, lt - page, len, complete);
+        if (tag_end == 0) {
+            scanner->pos = lt - page;
+            return scanner->pos;
+        }
+        scanner->pos = tag_end;
+    }
+    return scanner->pos;
+}
+
+// Copies a URL from the page into `dst`, resolving the character
+// references URLs tend to have. Returns 0 if it does not fit.
+size_t html_copy_url(char *dst, size_t cap, char *url, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = url[i];
+        if (c == '&') {
+            if (len - i >= 5 && strncasecmp(url + i, "&amp;", 5) == 0) i += 4;
+            else if (len - i >= 5 && strncmp(url + i, "&#38;", 5) == 0) i += 4;
+            else if (len - i >= 6 && strncasecmp(url + i, "&#x26;", 6) == 0) i += 5;
+        }
+        if (n + 1 >= cap) return 0;
+        dst[n++] = c;
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+// FNV-1a, to tell URLs that were seen before
+uint64_t html_hash(char *data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
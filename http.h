@@ -7,16 +7,35 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "b64/b64.h"
 
 #define LISTEN_BACKLOG 32
+#define HTTP_MAX_EVENTS 64
+#define HTTP_MAX_CONNS 1024
+// Request line and headers must fit into this, bodies get their own room
+#define HTTP_MAX_HEAD_SIZE 8*1024
+#define HTTP_MAX_BODY_SIZE 1024*1024
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_QUERY 32
+#define HTTP_KV_LEN 256
+#define HTTP_TICK_MS 1000
+// Connection is dropped if nothing is read or written for this long
+#define HTTP_IDLE_TIMEOUT_MS 30000
+// Whole request head must arrive within this, so slowloris clients can't hold a slot
+#define HTTP_HEADER_TIMEOUT_MS 10000
 
-#define HTTP_BAD_REQUEST "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n\r\n"
-#define HTTP_NOT_FOUND "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n\r\n"
 #define URL_MAX_LEN 1024
 
 typedef struct KV {
     char k[64];
-    char v[64];
+    char v[HTTP_KV_LEN];
 } KV;
 
 typedef KV HttpHeader;
@@ -33,27 +52,107 @@ typedef struct {
     size_t headers_count;
 } HttpResp;
 
+// Points into the connection's read buffer, which the parser NUL-terminates
+// in place, so headers are never copied
+typedef struct {
+    char *name;
+    char *value;
+} HttpHeaderRef;
+
 typedef struct {
     char method[8];
     char path[URL_MAX_LEN];
     char url[URL_MAX_LEN];
     int clientfd;
-    KV query[32];
+    KV query[HTTP_MAX_QUERY];
     size_t query_count;
+    HttpHeaderRef headers[HTTP_MAX_HEADERS];
+    size_t headers_count;
+    bool http10;
+    bool keep_alive;
+    char *body;
+    size_t body_len;
 } HttpReq;
 
+typedef enum {
+    HTTP_PARSE_REQUEST_LINE,
+    HTTP_PARSE_HEADERS,
+    HTTP_PARSE_BODY,
+} HttpParseState;
+
+// Parsing state kept between reads, so a request arriving in pieces is
+// scanned only once
+typedef struct {
+    HttpParseState state;
+    // Start of the line being parsed
+    size_t line;
+    // How far the current line has been searched for its end
+    size_t scanned;
+    size_t head_len;
+    size_t content_length;
+} HttpParser;
+
+typedef enum {
+    HTTP_CONN_READING,
+    // Request is owned by a handler (possibly on another thread) until http_complete
+    HTTP_CONN_HANDLING,
+    HTTP_CONN_WRITING,
+} HttpConnState;
+
+typedef struct HttpConn {
+    int fd;
+    size_t slot;
+    HttpConnState state;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    HttpParser parser;
+    // Size of the request being handled, the rest of `in` is pipelined requests
+    size_t request_len;
+    bool eof;
+    HttpBody out;
+    size_t out_sent;
+    long long last_active_ms;
+    long long request_start_ms;
+    HttpReq request;
+    struct HttpConn *next_done;
+} HttpConn;
+
+typedef struct HttpServer HttpServer;
+
+// Called on the loop thread once a full request is read. The handler must
+// eventually respond and call http_complete, from any thread.
+typedef void (*HttpHandler)(HttpServer *server, HttpConn *conn);
+
+struct HttpServer {
+    int sockfd;
+    int epollfd;
+    int eventfd;
+    HttpHandler handler;
+    HttpConn *conns[HTTP_MAX_CONNS];
+    size_t conns_count;
+    pthread_mutex_t done_lock;
+    HttpConn *done;
+};
+
 size_t http_body_appendf(HttpBody *body, char *fmt, ...);
+size_t http_body_append_b64(HttpBody *body, const unsigned char *data, size_t size);
 
 int http_server(uint16_t port);
-int http_next_request(int sockfd, HttpReq *request);
-int http_respond(int clientfd, int status, HttpResp *response);
+int http_loop(HttpServer *server, int sockfd, HttpHandler handler);
+int http_next_request(HttpConn *conn, HttpReq *request);
+int http_respond(HttpConn *conn, int status, HttpResp *response);
+void http_complete(HttpServer *server, HttpConn *conn);
 
-int http_not_found(int clientfd);
+int http_not_found(HttpConn *conn);
+int http_unavailable(HttpConn *conn);
 
 size_t http_trim_query(char *url, char *path);
 size_t http_parse_url_and_query(char *url, char *path, KV *query_buf);
 int    http_get_query_param(HttpReq *request, char *param, char *buf);
+char  *http_get_header(HttpReq *request, char *name);
 size_t http_get_host(char *buf, char *url);
+bool   http_resolve_url(char *out, size_t cap, char *base, char *ref);
 
 int has_http_prefix(char *str)     { return strncmp("http://", str, 7) == 0; }
 int has_https_prefix(char *str)    { return strncmp("https://", str, 8) == 0; }
@@ -65,15 +164,33 @@ HttpBody *http_body_realloc(HttpBody *body, size_t size) {
     return body;
 }
 
+size_t http_body_append(HttpBody *body, char *data, size_t size) {
+    if (body->cap - body->len < size) http_body_realloc(body, size);
+    memcpy(&body->ptr[body->len], data, size);
+    body->len += size;
+    return size;
+}
+
+// Encodes `data` as base64 straight into the body
+size_t http_body_append_b64(HttpBody *body, const unsigned char *data, size_t size) {
+    size_t b64_size = b64_encoded_size(size);
+    if (body->cap - body->len < b64_size) http_body_realloc(body, b64_size);
+    size = b64_encode_to(data, size, &body->ptr[body->len]);
+    body->len += size;
+    return size;
+}
+
 size_t http_body_appendf(HttpBody *body, char *fmt, ...) {
-    va_list va;
+    va_list va, retry;
 	va_start(va, fmt);
+	va_copy(retry, va);
 	size_t space = body->cap - body->len;
 	size_t size = vsnprintf(&body->ptr[body->len], space, fmt, va);
 	if (size >= space) {
-    	http_body_realloc(body, size);
-    	vsprintf(&body->ptr[body->len], fmt, va);
+    	http_body_realloc(body, size+1);
+    	vsprintf(&body->ptr[body->len], fmt, retry);
 	}
+	va_end(retry);
 	va_end(va);
 	body->len += size;
 	return size;
@@ -90,6 +207,70 @@ size_t http_get_host(char *buf, char *url) {
     return buf_i;
 }
 
+// Resolves `ref` against the absolute http(s) URL `base` the way browsers
+// resolve links, dropping the fragment. False if the result would not fit
+// in `cap` bytes.
+bool http_resolve_url(char *out, size_t cap, char *base, char *ref) {
+    char *authority = strstr(base, "://");
+    if (authority == NULL) return false;
+    authority += 3;
+    size_t scheme_len = authority - 2 - base;
+    size_t origin_len = authority + strcspn(authority, "/?#") - base;
+    size_t ref_len = strcspn(ref, "#");
+    size_t prefix_len;
+    bool slash = false;
+    if (has_protocol_prefix(ref)) {
+        prefix_len = 0;
+    } else if (strncmp(ref, "//", 2) == 0) {
+        prefix_len = scheme_len;
+    } else if (ref[0] == '/') {
+        prefix_len = origin_len;
+    } else if (ref[0] == '?') {
+        prefix_len = strcspn(base, "?#");
+    } else if (ref_len == 0) {
+        prefix_len = strcspn(base, "#");
+    } else {
+        // Relative to the directory of the base's path
+        prefix_len = strcspn(base, "?#");
+        while (prefix_len > origin_len && base[prefix_len - 1] != '/') prefix_len--;
+        slash = prefix_len == origin_len;
+    }
+    if (prefix_len + slash + ref_len + 1 > cap) return false;
+    memcpy(out, base, prefix_len);
+    if (slash) out[prefix_len++] = '/';
+    memcpy(out + prefix_len, ref, ref_len);
+    out[prefix_len + ref_len] = '\0';
+
+    // Takes the . and .. segments out of the path, in place
+    char *path = strstr(out, "://");
+    if (path == NULL) return true;
+    path += 3;
+    path += strcspn(path, "/?");
+    if (*path != '/') return true;
+    char *end = path + strcspn(path, "?");
+    char *r = path;
+    char *w = path;
+    while (r < end) {
+        char *segment = r + 1;
+        char *segment_end = memchr(segment, '/', end - segment);
+        if (segment_end == NULL) segment_end = end;
+        size_t len = segment_end - segment;
+        if ((len == 1 && segment[0] == '.') || (len == 2 && segment[0] == '.' && segment[1] == '.')) {
+            if (len == 2) {
+                while (w > path && *--w != '/');
+            }
+            if (segment_end == end) *w++ = '/';
+        } else {
+            *w++ = '/';
+            memmove(w, segment, len);
+            w += len;
+        }
+        r = segment_end;
+    }
+    memmove(w, end, strlen(end) + 1);
+    return true;
+}
+
 int http_get_query_param(HttpReq *request, char *param, char *buf) {
     for (size_t i = 0; i < request->query_count; i++) {
         if (strcmp(request->query[i].k, param) == 0) {
@@ -100,6 +281,30 @@ int http_get_query_param(HttpReq *request, char *param, char *buf) {
     return 0;
 }
 
+char *http_get_header(HttpReq *request, char *name) {
+    for (size_t i = 0; i < request->headers_count; i++) {
+        if (strcasecmp(request->headers[i].name, name) == 0) {
+            return request->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+char *http_status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 413: return "Content Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        case 505: return "HTTP Version Not Supported";
+        default:  return "Unknown";
+    }
+}
+
 int http_server(uint16_t port) {
     int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (sockfd < 0) {
@@ -127,26 +332,29 @@ int http_server(uint16_t port) {
     return sockfd;
 }
 
-int http_not_found(int clientfd) {
-    return write(clientfd, HTTP_NOT_FOUND, strlen(HTTP_NOT_FOUND));
+int http_not_found(HttpConn *conn) {
+    HttpResp response = {0};
+    return http_respond(conn, 404, &response);
 }
 
-int http_respond(int clientfd, int status, HttpResp *response) {
-    char buf[sizeof(HttpResp)];
-    int size = sprintf(buf, "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\nConnection: close\r\n", status, "TODO", response->body.len);
+int http_unavailable(HttpConn *conn) {
+    HttpResp response = {0};
+    strcpy(response.headers[0].k, "Retry-After");
+    strcpy(response.headers[0].v, "1");
+    response.headers_count = 1;
+    return http_respond(conn, 503, &response);
+}
+
+// Responses are only queued into conn->out here, the loop sends them once
+// the handler calls http_complete.
+int http_respond(HttpConn *conn, int status, HttpResp *response) {
+    size_t size = http_body_appendf(&conn->out, "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\nConnection: %s\r\n",
+        status, http_status_text(status), response->body.len, conn->request.keep_alive ? "keep-alive" : "close");
     for (size_t i = 0; i < response->headers_count; i++) {
-        size += sprintf(buf+size, "%s: %s\r\n", response->headers[i].k, response->headers[i].v);
-    }
-    memcpy(buf+size, "\r\n", 2);
-    size += 2;
-    if (response->body.len == 0) {
-        memcpy(buf+size, "\r\n", 2);
-        size += 2;
-        return write(clientfd, buf, size);
-    }
-    write(clientfd, buf, size);
-    size += write(clientfd, response->body.ptr, response->body.len);
-    size += write(clientfd, "\r\n", 2);
+        size += http_body_appendf(&conn->out, "%s: %s\r\n", response->headers[i].k, response->headers[i].v);
+    }
+    size += http_body_append(&conn->out, "\r\n", 2);
+    size += http_body_append(&conn->out, response->body.ptr, response->body.len);
     return size;
 }
 
@@ -158,50 +366,434 @@ size_t http_trim_query(char *url, char *trimmed) {
     return i;
 }
 
+int http_hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes `%XX` escapes and `+` from [src, src+len) into dst. Returns the
+// decoded length, or (size_t)-1 if it was cut off to fit in dst_size.
+size_t http_percent_decode(char *dst, size_t dst_size, char *src, size_t len) {
+    size_t d = 0;
+    size_t i = 0;
+    for (; i < len && d < dst_size-1; i++) {
+        if (src[i] == '%' && i+2 < len && http_hex_value(src[i+1]) >= 0 && http_hex_value(src[i+2]) >= 0) {
+            dst[d++] = http_hex_value(src[i+1])*16 + http_hex_value(src[i+2]);
+            i += 2;
+        } else if (src[i] == '+') {
+            dst[d++] = ' ';
+        } else {
+            dst[d++] = src[i];
+        }
+    }
+    dst[d] = '\0';
+    return i < len ? (size_t)-1 : d;
+}
+
 size_t http_parse_url_and_query(char *url, char *without_query, KV *query_buf) {
     size_t url_len = strlen(url);
-    size_t query_i = http_trim_query(url, without_query);
-    query_i++;
+    size_t query_i = http_trim_query(url, without_query) + 1;
     size_t query_count = 0;
-    for (; query_i < url_len; query_count++) {
-        size_t k = 0;
-        for (; query_i < url_len && url[query_i] != '='; query_i++) {
-            (query_buf+query_count)->k[k++] = url[query_i];
-        }
-        (query_buf+query_count)->k[k] = '\0';
-        query_i++;
-        size_t v = 0;
-        for (; query_i < url_len && url[query_i] != '&'; query_i++) {
-            (query_buf+query_count)->v[v++] = url[query_i];
-        }
-        (query_buf+query_count)->v[v] = '\0';
-        query_i++;
+    while (query_i < url_len && query_count < HTTP_MAX_QUERY) {
+        char *param = url+query_i;
+        char *param_end = memchr(param, '&', url_len - query_i);
+        if (param_end == NULL) param_end = url+url_len;
+        query_i = param_end - url + 1;
+        if (param_end == param) continue;
+        char *eq = memchr(param, '=', param_end - param);
+        char *k_end = eq ? eq : param_end;
+        char *v = eq ? eq+1 : param_end;
+        KV *kv = &query_buf[query_count++];
+        // Cut off values would be taken for something else, such as a
+        // shorter URL
+        if (http_percent_decode(kv->k, sizeof(kv->k), param, k_end - param) == (size_t)-1) return (size_t)-1;
+        if (http_percent_decode(kv->v, sizeof(kv->v), v, param_end - v) == (size_t)-1) return (size_t)-1;
     }
     return query_count;
 }
 
-int http_next_request(int sockfd, HttpReq *request) {
-    request->clientfd = accept(sockfd, NULL, NULL);
-    if (request->clientfd < 0) {
-        dprintf(2, "Could not accept client: %s\n", strerror(errno));
-        return -1;
+void http_parser_reset(HttpParser *parser) {
+    memset(parser, 0, sizeof(*parser));
+}
+
+// Makes room for the whole body. Realloc may move the buffer, so header
+// pointers already handed out are moved along with it.
+bool http_conn_reserve(HttpConn *conn, HttpReq *request, size_t size) {
+    if (conn->in_cap >= size) return true;
+    size_t offsets[HTTP_MAX_HEADERS][2];
+    for (size_t i = 0; i < request->headers_count; i++) {
+        offsets[i][0] = request->headers[i].name - conn->in;
+        offsets[i][1] = request->headers[i].value - conn->in;
     }
-    char buf[sizeof(HttpReq)];
-    
-    int read_bytes = read(request->clientfd, buf, sizeof(HttpReq));
-    int req_len = read_bytes;
+    char *in = realloc(conn->in, size);
+    if (in == NULL) return false;
+    for (size_t i = 0; i < request->headers_count; i++) {
+        request->headers[i].name = in + offsets[i][0];
+        request->headers[i].value = in + offsets[i][1];
+    }
+    conn->in = in;
+    conn->in_cap = size;
+    return true;
+}
+
+int http_parse_request_line(char *line, HttpReq *request) {
+    char *method_end = strchr(line, ' ');
+    if (method_end == NULL || method_end == line || method_end - line >= sizeof(request->method)) return -400;
+    char *url = method_end+1;
+    char *url_end = strchr(url, ' ');
+    if (url_end == NULL || url_end == url) return -400;
+    if (url_end - url >= URL_MAX_LEN) return -431;
+    char *version = url_end+1;
+    if (strncmp(version, "HTTP/1.", 7) != 0 || version[7] < '0' || version[7] > '9' || version[8] != '\0') return -505;
     
-    int cur = 0;
-    for (; cur < req_len && buf[cur] != ' '; cur++) {
-        request->method[cur] = buf[cur];
+    memcpy(request->method, line, method_end - line);
+    request->method[method_end - line] = '\0';
+    memcpy(request->url, url, url_end - url);
+    request->url[url_end - url] = '\0';
+    request->query_count = http_parse_url_and_query(request->url, request->path, request->query);
+    if (request->query_count == (size_t)-1) return -431;
+    request->http10 = version[7] == '0';
+    request->headers_count = 0;
+    request->body = NULL;
+    request->body_len = 0;
+    return 0;
+}
+
+int http_parse_header_line(char *line, HttpReq *request) {
+    char *colon = strchr(line, ':');
+    if (colon == NULL || colon == line) return -400;
+    for (char *c = line; c < colon; c++) {
+        if (*c == ' ' || *c == '\t') return -400;
+    }
+    if (request->headers_count == HTTP_MAX_HEADERS) return -431;
+    *colon = '\0';
+    char *value = colon+1;
+    while (*value == ' ' || *value == '\t') value++;
+    char *value_end = value + strlen(value);
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+    *value_end = '\0';
+    request->headers[request->headers_count].name = line;
+    request->headers[request->headers_count].value = value;
+    request->headers_count++;
+    return 0;
+}
+
+// Called once the empty line after the headers is reached
+int http_parse_head_end(HttpReq *request, HttpParser *parser) {
+    if (http_get_header(request, "Transfer-Encoding") != NULL) return -501;
+    char *content_length = http_get_header(request, "Content-Length");
+    parser->content_length = 0;
+    if (content_length != NULL) {
+        char *end;
+        unsigned long long len = strtoull(content_length, &end, 10);
+        if (end == content_length || *end != '\0') return -400;
+        if (len > HTTP_MAX_BODY_SIZE) return -413;
+        parser->content_length = len;
+    }
+    char *connection = http_get_header(request, "Connection");
+    if (request->http10) request->keep_alive = connection != NULL && strcasecmp(connection, "keep-alive") == 0;
+    else request->keep_alive = connection == NULL || strcasecmp(connection, "close") != 0;
+    return 0;
+}
+
+// Parses the request at the start of the connection's read buffer, resuming
+// where the previous call stopped. Returns the request size (head and body)
+// once it is complete, 0 if more bytes are needed, or a negated HTTP status
+// if the request is rejected.
+int http_next_request(HttpConn *conn, HttpReq *request) {
+    HttpParser *parser = &conn->parser;
+    request->clientfd = conn->fd;
+    for (;;) {
+        if (parser->state == HTTP_PARSE_BODY) {
+            size_t len = parser->head_len + parser->content_length;
+            if (conn->in_len < len) {
+                if (!http_conn_reserve(conn, request, len)) return -413;
+                return 0;
+            }
+            request->body = conn->in + parser->head_len;
+            request->body_len = parser->content_length;
+            http_parser_reset(parser);
+            return len;
+        }
+        
+        char *nl = memchr(conn->in + parser->scanned, '\n', conn->in_len - parser->scanned);
+        if (nl == NULL) {
+            parser->scanned = conn->in_len;
+            if (conn->in_len >= HTTP_MAX_HEAD_SIZE) return -431;
+            return 0;
+        }
+        char *line = conn->in + parser->line;
+        char *line_end = nl;
+        if (line_end > line && line_end[-1] == '\r') line_end--;
+        *line_end = '\0';
+        parser->line = parser->scanned = nl - conn->in + 1;
+        if (parser->line > HTTP_MAX_HEAD_SIZE) return -431;
+        
+        int err = 0;
+        if (parser->state == HTTP_PARSE_REQUEST_LINE) {
+            // Empty lines before the request line are allowed
+            if (line == line_end) continue;
+            err = http_parse_request_line(line, request);
+            parser->state = HTTP_PARSE_HEADERS;
+        } else if (line == line_end) {
+            err = http_parse_head_end(request, parser);
+            parser->head_len = parser->line;
+            parser->state = HTTP_PARSE_BODY;
+        } else {
+            err = http_parse_header_line(line, request);
+        }
+        if (err < 0) {
+            http_parser_reset(parser);
+            return err;
+        }
+    }
+}
+
+long long http_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000LL + ts.tv_nsec/1000000;
+}
+
+int http_set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void http_conn_watch(HttpServer *server, HttpConn *conn, int op, uint32_t events) {
+    struct epoll_event ev = {.events = events, .data = {.ptr = conn}};
+    epoll_ctl(server->epollfd, op, conn->fd, &ev);
+}
+
+void http_conn_close(HttpServer *server, HttpConn *conn) {
+    epoll_ctl(server->epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    server->conns[conn->slot] = server->conns[--server->conns_count];
+    server->conns[conn->slot]->slot = conn->slot;
+    free(conn->in);
+    free(conn->out.ptr);
+    free(conn);
+}
+
+// For requests that can't be parsed, the connection is closed right after
+void http_send_error(HttpConn *conn, int status) {
+    char buf[128];
+    int size = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+        status, http_status_text(status));
+    send(conn->fd, buf, size, MSG_NOSIGNAL);
+}
+
+void http_accept(HttpServer *server) {
+    for (;;) {
+        int fd = accept4(server->sockfd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                dprintf(2, "Could not accept client: %s\n", strerror(errno));
+            }
+            return;
+        }
+        if (server->conns_count == HTTP_MAX_CONNS) {
+            dprintf(2, "Too many connections, dropping client\n");
+            close(fd);
+            continue;
+        }
+        HttpConn *conn = calloc(1, sizeof(HttpConn));
+        conn->fd = fd;
+        conn->in_cap = HTTP_MAX_HEAD_SIZE;
+        conn->in = malloc(conn->in_cap);
+        conn->state = HTTP_CONN_READING;
+        conn->last_active_ms = http_now_ms();
+        conn->request_start_ms = conn->last_active_ms;
+        struct epoll_event ev = {.events = EPOLLIN|EPOLLRDHUP, .data = {.ptr = conn}};
+        if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            dprintf(2, "Could not watch client: %s\n", strerror(errno));
+            close(fd);
+            free(conn->in);
+            free(conn);
+            continue;
+        }
+        conn->slot = server->conns_count;
+        server->conns[server->conns_count++] = conn;
     }
-    request->method[cur] = '\0';
-    int path_start = ++cur;
-    for (; cur < req_len && buf[cur] != ' ' && cur-path_start < URL_MAX_LEN; cur++) {
-        request->url[cur-path_start] = buf[cur];
+}
+
+void http_conn_process(HttpServer *server, HttpConn *conn);
+
+// Drops the answered request from the read buffer and moves on to the next
+// pipelined one, or waits for it to arrive
+void http_conn_next(HttpServer *server, HttpConn *conn) {
+    conn->in_len -= conn->request_len;
+    memmove(conn->in, conn->in+conn->request_len, conn->in_len);
+    conn->request_len = 0;
+    conn->out.len = 0;
+    conn->out_sent = 0;
+    conn->state = HTTP_CONN_READING;
+    conn->request_start_ms = http_now_ms();
+    http_conn_watch(server, conn, EPOLL_CTL_MOD, EPOLLIN|EPOLLRDHUP);
+    http_conn_process(server, conn);
+}
+
+// Returns false if the connection was closed
+bool http_conn_flush(HttpServer *server, HttpConn *conn) {
+    while (conn->out_sent < conn->out.len) {
+        ssize_t sent = send(conn->fd, conn->out.ptr+conn->out_sent, conn->out.len-conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                http_conn_watch(server, conn, EPOLL_CTL_MOD, EPOLLOUT);
+                return true;
+            }
+            http_conn_close(server, conn);
+            return false;
+        }
+        conn->out_sent += sent;
+        conn->last_active_ms = http_now_ms();
+    }
+    if (!conn->request.keep_alive) {
+        http_conn_close(server, conn);
+        return false;
     }
-    request->url[cur-path_start] = '\0';
+    http_conn_next(server, conn);
+    return true;
+}
+
+void http_conn_process(HttpServer *server, HttpConn *conn) {
+    int req_len = http_next_request(conn, &conn->request);
+    if (req_len == 0) {
+        if (conn->eof) http_conn_close(server, conn);
+        return;
+    }
+    if (req_len < 0) {
+        dprintf(2, "Rejecting request with %d %s\n", -req_len, http_status_text(-req_len));
+        http_send_error(conn, -req_len);
+        http_conn_close(server, conn);
+        return;
+    }
+    // Client has stopped sending, so there is nothing to keep the connection for
+    if (conn->eof && req_len == conn->in_len) conn->request.keep_alive = false;
+    conn->request_len = req_len;
+    conn->state = HTTP_CONN_HANDLING;
+    // Not watched while handling: a hang up would otherwise be reported on every wait
+    epoll_ctl(server->epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    server->handler(server, conn);
+}
+
+void http_conn_read(HttpServer *server, HttpConn *conn) {
+    while (conn->in_len < conn->in_cap) {
+        ssize_t n = read(conn->fd, conn->in+conn->in_len, conn->in_cap-conn->in_len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            http_conn_close(server, conn);
+            return;
+        }
+        if (n == 0) {
+            conn->eof = true;
+            break;
+        }
+        if (conn->in_len == 0) conn->request_start_ms = http_now_ms();
+        conn->in_len += n;
+        conn->last_active_ms = http_now_ms();
+    }
+    http_conn_process(server, conn);
+}
+
+void http_complete(HttpServer *server, HttpConn *conn) {
+    pthread_mutex_lock(&server->done_lock);
+    conn->next_done = server->done;
+    server->done = conn;
+    pthread_mutex_unlock(&server->done_lock);
+    uint64_t one = 1;
+    write(server->eventfd, &one, sizeof(one));
+}
+
+void http_drain_completed(HttpServer *server) {
+    uint64_t count;
+    read(server->eventfd, &count, sizeof(count));
+    pthread_mutex_lock(&server->done_lock);
+    HttpConn *conn = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->done_lock);
+    while (conn != NULL) {
+        HttpConn *next = conn->next_done;
+        conn->state = HTTP_CONN_WRITING;
+        conn->last_active_ms = http_now_ms();
+        http_conn_watch(server, conn, EPOLL_CTL_ADD, 0);
+        http_conn_flush(server, conn);
+        conn = next;
+    }
+}
+
+void http_expire_conns(HttpServer *server) {
+    long long now = http_now_ms();
+    for (size_t i = 0; i < server->conns_count;) {
+        HttpConn *conn = server->conns[i];
+        bool idle = now - conn->last_active_ms > HTTP_IDLE_TIMEOUT_MS;
+        bool slow = conn->state == HTTP_CONN_READING && conn->in_len > 0 &&
+            now - conn->request_start_ms > HTTP_HEADER_TIMEOUT_MS;
+        if (conn->state != HTTP_CONN_HANDLING && (idle || slow)) {
+            http_conn_close(server, conn);
+            continue;
+        }
+        i++;
+    }
+}
+
+int http_loop(HttpServer *server, int sockfd, HttpHandler handler) {
+    server->sockfd = sockfd;
+    server->handler = handler;
+    server->conns_count = 0;
+    server->done = NULL;
+    pthread_mutex_init(&server->done_lock, NULL);
+    if (http_set_nonblocking(sockfd) < 0) {
+        dprintf(2, "Could not make socket non-blocking: %s\n", strerror(errno));
+        return -1;
+    }
+    server->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    server->eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (server->epollfd < 0 || server->eventfd < 0) {
+        dprintf(2, "Could not create epoll: %s\n", strerror(errno));
+        return -1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data = {.ptr = server}};
+    epoll_ctl(server->epollfd, EPOLL_CTL_ADD, sockfd, &ev);
+    ev.data.ptr = &server->eventfd;
+    epoll_ctl(server->epollfd, EPOLL_CTL_ADD, server->eventfd, &ev);
     
-    request->query_count = http_parse_url_and_query(request->url, request->path, request->query);
-    return request->clientfd;
+    struct epoll_event events[HTTP_MAX_EVENTS];
+    long long last_expire = http_now_ms();
+    for (;;) {
+        int n = epoll_wait(server->epollfd, events, HTTP_MAX_EVENTS, HTTP_TICK_MS);
+        if (n < 0 && errno != EINTR) {
+            dprintf(2, "epoll_wait failed: %s\n", strerror(errno));
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == server) {
+                http_accept(server);
+                continue;
+            }
+            if (ptr == &server->eventfd) {
+                http_drain_completed(server);
+                continue;
+            }
+            HttpConn *conn = ptr;
+            if (events[i].events & (EPOLLERR|EPOLLHUP)) {
+                http_conn_close(server, conn);
+            } else if (conn->state == HTTP_CONN_WRITING) {
+                if (events[i].events & EPOLLOUT) http_conn_flush(server, conn);
+            } else if (events[i].events & (EPOLLIN|EPOLLRDHUP)) {
+                http_conn_read(server, conn);
+            }
+        }
+        if (http_now_ms() - last_expire >= HTTP_TICK_MS) {
+            http_expire_conns(server);
+            last_expire = http_now_ms();
+        }
+    }
+    return 0;
 }
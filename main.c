@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
@@ -15,8 +16,6 @@
 
 #include "webp/encode.h"
 #include "webp/decode.h"
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
 #ifdef JPEG_STBI
     #define STB_IMAGE_WRITE_IMPLEMENTATION
     #include "stb_image_write.h"
@@ -30,14 +29,26 @@
 #include "http.h"
 #include "unavailable_b64.h"
 #include "da.h"
+#include "html.h"
+#include "css.h"
+#include "pool.h"
+#include "bufpool.h"
+#include "yuv.h"
+#include "sink.h"
+#include "fetch.h"
+#include "decoder.h"
+#include "encoder.h"
 
 #define PORT 3456
 #define QUALITY 80
+// 0 is slowest and smallest, 10 fastest
+#define AVIF_SPEED 8
+#define AVIF_THREADS 2
 #define INITIAL_REPORTS 32
 #define MAX_EXT_LEN 8
 
-#ifndef MAX_CURL_THREADS
-#define MAX_CURL_THREADS 10
+#ifndef MAX_CURL_TRANSFERS
+#define MAX_CURL_TRANSFERS 10
 #endif
 #define CURL_IMG_TIMEOUT 5000
 #define CURL_PAGE_TIMEOUT 15000
@@ -46,126 +57,201 @@
 
 #define WEBPAGE_BUF_SIZE 1024*1024
 #define FILE_BUF_SIZE    20*1024*1024
-#define DECODE_BUF_SIZE  200*1024*1024
+#define MAX_IMAGE_BYTES  FILE_BUF_SIZE
+#define MAX_PIXELS       50*1000*1000
+#define REPORT_BYTES     100*1024*1024
+// Idle pixel buffers beyond this many bytes are freed instead of kept for reuse
+#define PIXEL_POOL_MAX_BYTES 256*1024*1024
+#define ENCODED_POOL_MAX_BYTES 64*1024*1024
+// Encoders start out with room for this much output when the image size
+// is not known yet
+#define ENCODED_SIZE_HINT 256*1024
+// Encoders writing to a file hand the output over in windows of this size
+#define ENCODE_WINDOW 256*1024
+// Images are probed with a ranged request for this many bytes first
+#define PROBE_BYTES      8*1024
+// Linked stylesheets are followed through this many levels of @import
+#define CSS_DEPTH        3
+#define CSS_BYTES        2*1024*1024
 
-static char webpage_buf[WEBPAGE_BUF_SIZE];
-static char file_buf[FILE_BUF_SIZE];
-static char decode_buf[DECODE_BUF_SIZE];
-static char encode_buf[FILE_BUF_SIZE];
+#define JOBS_PER_WORKER 16
+// Images waiting for a decode or encode thread, per thread of that stage
+#define JOBS_PER_STAGE_THREAD 4
+// Downloaded bytes are handed to the decoder in pieces of at most this size
+#define DECODE_CHUNK 64*1024
+
+typedef struct {
+    // 0 means one worker per core
+    size_t workers;
+    // Downloads of bigger images are aborted
+    size_t max_image_bytes;
+    // Images with more pixels are skipped after probing and refused by the
+    // decoders
+    size_t max_pixels;
+    // Images stop being downloaded once a report has fetched this much
+    size_t report_bytes;
+    // Pages are cut off beyond this many bytes, 0 means no limit
+    size_t page_bytes;
+    // Stylesheets are followed this deep, a linked one being 1 and each
+    // @import adding 1. 0 only looks at the page's own <style> elements.
+    size_t css_depth;
+    // Stylesheets stop being downloaded once a report has fetched this much CSS
+    size_t css_bytes;
+    // 0 means one thread per core for each stage
+    size_t decode_threads;
+    size_t encode_threads;
+    // libavif's encoder speed (0-10) and quality (0-100)
+    size_t avif_speed;
+    size_t avif_quality;
+    // Threads libavif may use for each image, on top of the encode threads
+    size_t avif_threads;
+    // Splits AVIFs into 2^N x 2^N tiles that encode in parallel, 0 lets
+    // libavif choose from the image size and thread count
+    size_t avif_tile_log2;
+    // Non-zero logs how each report's images are scheduled
+    size_t debug;
+} Config;
+
+static Config config = {
+    .workers = 0,
+    .max_image_bytes = MAX_IMAGE_BYTES,
+    .max_pixels = MAX_PIXELS,
+    .report_bytes = REPORT_BYTES,
+    .page_bytes = 0,
+    .css_depth = CSS_DEPTH,
+    .css_bytes = CSS_BYTES,
+    .decode_threads = 0,
+    .encode_threads = 0,
+    .avif_speed = AVIF_SPEED,
+    .avif_quality = QUALITY,
+    .avif_threads = AVIF_THREADS,
+    .avif_tile_log2 = 0,
+    .debug = 0,
+};
+
+// Everything a request needs to run the pipeline, owned by a single worker
+// thread so requests never share buffers
+typedef struct {
+    size_t id;
+    Encoder encoder;
+    Fetcher fetcher;
+} Worker;
+
+void encoder_settings(EncoderSettings *settings) {
+    settings->quality = QUALITY;
+    settings->avif_speed = config.avif_speed;
+    settings->avif_quality = config.avif_quality;
+    settings->avif_threads = config.avif_threads;
+    settings->avif_tile_log2 = config.avif_tile_log2;
+}
+
+Worker *worker_alloc(size_t id) {
+    Worker *worker = malloc(sizeof(Worker));
+    worker->id = id;
+    EncoderSettings settings;
+    encoder_settings(&settings);
+    if (!encoder_init(&worker->encoder, ENCODE_WINDOW, &settings)) exit(1);
+    if (!fetcher_init(&worker->fetcher, MAX_CURL_TRANSFERS)) exit(1);
+    return worker;
+}
+
+// Decoded pixels live in buffers from this pool, handed back with img_data_free
+static BufPool pixel_pool;
+// Encoders write into buffers from this pool
+static BufPool encoded_pool;
 
 typedef struct {
     char *pixels;
+    size_t cap;
     int w;
     int h;
     int n;
+    // What the lossy encoders take instead of the pixels, see img_data_yuv
+    Yuv420 yuv;
 } ImgData;
 
+void img_data_free(ImgData *img) {
+    Buf buf = {.ptr = img->pixels, .cap = img->cap};
+    buf_pool_put(&pixel_pool, buf);
+    img->pixels = NULL;
+    if (img->yuv.y != NULL) yuv420_free(&img->yuv, &pixel_pool);
+}
+
+// Converts the pixels to YUV once for all lossy encoders. Images encoded by
+// several threads must have it done before the encoders start.
+bool img_data_yuv(ImgData *img) {
+    if (img->yuv.y != NULL) return TRUE;
+    return yuv420_from_rgb(&img->yuv, (const unsigned char*)img->pixels, img->w, img->h, img->n, &pixel_pool);
+}
+
 typedef struct {
     char *content;
     int len;
 } BufAndLen;
 
-#define EXTENSION_COUNT 3
-static char *extensions[EXTENSION_COUNT] = {"png", "webp", "jpeg"};
+#define EXTENSION_COUNT 4
+static char *extensions[EXTENSION_COUNT] = {"png", "webp", "jpeg", "avif"};
+// Rough time per pixel of encoding into each format, relative to jpeg
+static size_t encode_costs[EXTENSION_COUNT] = {3, 4, 1, 20};
 
 typedef struct {
-    char *b64_encoded;
+    // The encoded image, base64 encoded only when the report is written. The
+    // buffer is the one the encoder wrote into, from encoded_pool.
+    unsigned char *data;
     size_t size;
+    size_t cap;
 } Converted;
 
+void converted_free(Converted *converted) {
+    Buf buf = {.ptr = (char*)converted->data, .cap = converted->cap};
+    buf_pool_put(&encoded_pool, buf);
+    converted->data = NULL;
+}
+
 typedef struct {
     char src[URL_MAX_LEN];
     size_t original_ext;
     Converted extensions[EXTENSION_COUNT];
+    // Set for images that were probed but not downloaded
+    char skipped[128];
+    // Came from a data: URI, so there is nothing to link to
+    bool inline_data;
+    int w;
+    int h;
+    size_t size;
 } ImgReport;
 
-int encode_webp(ImgData *img, char *out) {
-    WebPPicture pic;
-    WebPPictureInit(&pic);
-    pic.width = img->w;
-    pic.height = img->h;
-    pic.writer = WebPMemoryWrite; 
-    WebPMemoryWriter wrt;
-    pic.custom_ptr = &wrt;
-    WebPPictureAlloc(&pic);
-    WebPMemoryWriterInit(&wrt);
-    
-    int import;
-    if (img->n == 4) import = WebPPictureImportRGBA(&pic, (const uint8_t*)img->pixels, img->w*img->n);
-    else if (img->n == 3) import = WebPPictureImportRGB(&pic, (const uint8_t*)img->pixels, img->w*img->n);
-    else {
-        dprintf(2, "ERROR: Don't know import function for %d components\n", img->n);
-        WebPPictureFree(&pic);
-        WebPMemoryWriterClear(&wrt);
-        return 0;
-    }
-    if (import < 1) {
-        dprintf(2, "ERROR: Importing pixels into webp failed with code %d\n", pic.error_code);
-        WebPPictureFree(&pic);
-        WebPMemoryWriterClear(&wrt);
-        return 0;
-    }
-    
-    WebPConfig config;
-    WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, QUALITY);
-    WebPEncode(&config, &pic);
-    
-    memcpy(out, wrt.mem, wrt.size);
-    int size = wrt.size;
-    
-    WebPPictureFree(&pic);
-    WebPMemoryWriterClear(&wrt);
-    return size;
-}
-
-int stbi_decode(ImgData *img, char *in, int in_len) {
-    int w, h, n;
-    char *data = (char*)stbi_load_from_memory((unsigned char*)in, in_len, &w, &h, &n, 0);
-    if (data == NULL) {
-        dprintf(2, "ERROR: stbi_load_from_memory error: %s\n", stbi_failure_reason());
-        return -1;
-    }
-    if (w*h*n > DECODE_BUF_SIZE) {
-        dprintf(2, "ERROR: %d is big for decoding\n", w*h*n);
-        free(data);
-        return -1;
-    } 
-    memcpy(img->pixels, data, w*h*n);
-    img->w = w;
-    img->h = h;
-    img->n = n;
-    free(data);
-    return 0;
-}
-
-size_t curl_callback(char *chunk, size_t _one, size_t chunk_size, BufAndLen *data) {
-    memcpy(data->content+data->len, chunk, chunk_size);
-    data->len += chunk_size;
-    return chunk_size;
-}
-
-int curl(BufAndLen *buf, char *url, int timeout) {
-    CURL *curl = curl_easy_init();
+CURL *curl_easy_for(Fetcher *fetcher, char *url, int timeout, void *callback, void *data, char *error) {
+    CURL *curl = fetcher_easy(fetcher);
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)buf);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, data);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
-    char error[1024];
     curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error);
-    CURLcode res = curl_easy_perform(curl);
-    curl_easy_cleanup(curl);
-    if (res != 0) {
+    error[0] = '\0';
+    return curl;
+}
+
+// Downloads `url` into a pooled buffer, which the caller releases with fetch_body_release
+int curl(Fetcher *fetcher, FetchBody *body, char *url, int timeout, size_t max) {
+    char error[CURL_ERROR_SIZE];
+    CURL *curl = curl_easy_for(fetcher, url, timeout, fetch_body_write, body, error);
+    fetch_body_init(body, fetcher, curl, max);
+    CURLcode res = fetcher_perform(fetcher, curl);
+    fetcher_release(fetcher, curl);
+    if (body->too_big) {
+        dprintf(2, "ERROR: %s is bigger than %zu bytes\n", url, max);
+        fetch_body_release(body);
+    } else if (res != 0) {
         dprintf(2, "ERROR: Could not get %s: %s (code %d)\n", url, error, res);
-        buf->len = 0;
+        fetch_body_release(body);
     }
-    return buf->len;
+    return body->len;
 }
 
 void stbi_encode_func(void *context, void *data, int size) {
-    BufAndLen *buf = (BufAndLen*)context;
-    memcpy(buf->content+buf->len, data, size);
-    buf->len += size;
+    sink_write((Sink*)context, data, size);
 }
 
 bool mkdir_p(char *path) {
@@ -192,299 +278,869 @@ bool mkdir_p(char *path) {
     return success;
 }
 
+void img_data_from_decoder(ImgData *img_data, Decoder *dec) {
+    img_data->pixels = (char*)dec->pixels;
+    img_data->cap = dec->pixels_cap;
+    img_data->w = dec->w;
+    img_data->h = dec->h;
+    img_data->n = dec->n;
+    memset(&img_data->yuv, 0, sizeof(Yuv420));
+    dec->pixels = NULL;
+}
+
 bool decode(ImgData *img_data, char *in_format, BufAndLen img) {
-    if (strcmp(in_format, "png") == 0 || strcmp(in_format, "jpeg") == 0 || strcmp(in_format, "jpg") == 0) {
-        if (stbi_decode(img_data, img.content, img.len) < 0) {
-            dprintf(2, "ERROR: Decoding failed for some reason\n");
-            return FALSE;
-        }
-    } else if (strcmp(in_format, "webp") == 0) {
-        unsigned char *webp = WebPDecodeRGB((unsigned char *)img.content, img.len, &img_data->w, &img_data->h);
-        if (webp == NULL) {
-            dprintf(2, "ERROR: WebPDecodeRGB failed\n");
-            return FALSE;
-        } else {
-            if (img_data->w*img_data->h > DECODE_BUF_SIZE) {
-                dprintf(2, "ERROR: %d is big for decoding\n", img_data->w*img_data->h);
-                return FALSE;
-            } else {
-                memcpy(img_data->pixels, webp, img_data->w*img_data->h);
-                img_data->n = 3;
-            }
-        }
-        if (webp != NULL) free(webp);
-    } else if (strcmp(in_format, "avif") == 0) {
-        dprintf(2, "ERROR: TODO: decode avif\n");
-        return FALSE;
-    } else {
-        dprintf(2, "ERROR: Don't know how to decode %s\n", in_format);
-        return FALSE;
+    img_data->pixels = NULL;
+    Decoder dec;
+    bool success = decoder_init(&dec, in_format, config.max_pixels, &pixel_pool);
+    if (success) {
+        decoder_decode(&dec, img.content, img.len);
+        success = decoder_finish(&dec);
     }
-    return img_data->w > 0 && img_data->h > 0;
+    if (success) img_data_from_decoder(img_data, &dec);
+    decoder_free(&dec);
+    return success;
 }
     
-size_t encode(ImgData *img_data, char *out_format, char *encode_buf) {
-    size_t encoded_size = 0;
-    if (strcmp(out_format, "png") == 0) {
-        png_image png = {0};
-        png.version = PNG_IMAGE_VERSION;
-        png.opaque = NULL;
-        png.width = img_data->w;
-        png.height = img_data->h;
-        png.format = PNG_FORMAT_RGB;
-        png.colormap_entries = 0;
-        
-        png_alloc_size_t size;
-        png_image_write_get_memory_size(png, size, 0, img_data->pixels, 0, NULL);
-        png_image_write_to_memory(&png, encode_buf, &size, 0, img_data->pixels, 0, NULL);
-        encoded_size = (int)size;
-    } else if (strcmp(out_format, "jpeg") == 0) {
+// Returns the size of the image written to `out`, or 0 if it failed
+size_t encode(ImgData *img_data, char *out_format, Encoder *enc, Sink *out) {
+    bool ok;
 #ifdef JPEG_STBI
-        BufAndLen buf = {0};
-        buf.content = encode_buf;
-        int result = stbi_write_jpg_to_func(&stbi_encode_func, &buf, img_data->w,
+    if (strcmp(out_format, "jpeg") == 0) {
+        ok = stbi_write_jpg_to_func(&stbi_encode_func, out, img_data->w,
             img_data->h, img_data->n, img_data->pixels, QUALITY);
-        if (result < 1) {
+        if (!ok) {
             dprintf(2, "ERROR: stbi_write_jpg_to_func failed\n");
         }
-        encoded_size = buf.len;
-#else
-        struct jpeg_error_mgr jerr;
-        struct jpeg_compress_struct cinfo;
-        cinfo.err = jpeg_std_error(&jerr);
-        jpeg_create_compress(&cinfo);
-        cinfo.image_width = img_data->w;
-        cinfo.image_height = img_data->h;
-        cinfo.input_components = img_data->n;
-        if (img_data->n == 4) cinfo.in_color_space = JCS_EXT_RGBA;
-        else if (img_data->n == 3) cinfo.in_color_space = JCS_RGB;
-        else {
-            dprintf(2, "ERROR: don't know JPEG's in_color_space for %d components\n", img_data->n);
-            goto done;
-        }
-        unsigned long jpeg_size = 0;
-        unsigned char *jpeg_buf = NULL;
-        jpeg_mem_dest(&cinfo, &jpeg_buf, &jpeg_size);
-        jpeg_set_defaults(&cinfo);
-        jpeg_set_quality(&cinfo, QUALITY, TRUE);
-        jpeg_start_compress(&cinfo, TRUE);
-        int row_stride = img_data->w * img_data->n;
-        JSAMPROW row_pointer[1]; 
-        while (cinfo.next_scanline < cinfo.image_height) {
-          /* jpeg_write_scanlines expects an array of pointers to scanlines.
-           * Here the array is only one element long, but you could pass
-           * more than one scanline at a time if that's more convenient.
-           */
-            row_pointer[0] = (unsigned char*)&img_data->pixels[cinfo.next_scanline * row_stride];
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
-        jpeg_finish_compress(&cinfo);
-        jpeg_destroy_compress(&cinfo);
-        encoded_size = (int)jpeg_size;
-        memcpy(encode_buf, jpeg_buf, encoded_size);
-        free(jpeg_buf);
+        return sink_finish(out) && ok ? sink_size(out) : 0;
+    }
 #endif
-    } else if (strcmp(out_format, "webp") == 0) {
-        encoded_size = encode_webp(img_data, encode_buf);
-    } else if (strcmp(out_format, "avif") == 0) {
-        dprintf(2, "ERROR: TODO: encode avif\n");
-        goto done;
+    if (strcmp(out_format, "png") != 0 && !img_data_yuv(img_data)) return 0;
+    ok = encoder_encode(enc, out_format, (const unsigned char*)img_data->pixels, img_data->w, img_data->h, img_data->n, &img_data->yuv, out);
+    return sink_finish(out) && ok ? sink_size(out) : 0;
+}
+
+// Images of one report move through three stages: the worker's fetcher
+// downloads them, the decode stage turns them into pixels while they are
+// still downloading and the encode stage converts those, one job per target
+// format so the formats of a big image are encoded side by side from the
+// same pixels. Each stage has its own threads and a bounded queue in front
+// of it, so a full queue holds back the stage feeding it while downloads,
+// decoding and encoding of different images overlap. Both queues hand out
+// the most expensive image first, so a huge image found late on the page
+// doesn't end up running alone at the end.
+static Pool decode_stage;
+static Pool encode_stage;
+
+// Collects the reports of one page as its images leave the pipeline
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    DA *reports;
+    size_t pending;
+    char *url;
+    size_t decodes_started;
+    // What is left of the report's download budget. Images of known size
+    // are charged before they are downloaded, the others as their bytes
+    // arrive. Only touched on the worker's thread.
+    size_t budget;
+} PageJob;
+
+// The transfers of the first phase are the page itself, image probes and
+// stylesheets, told apart by the kind they all start with
+typedef enum {
+    PAGE_FETCH_IMAGE,
+    PAGE_FETCH_STYLESHEET,
+    PAGE_FETCH_HTML,
+} PageFetchKind;
+
+typedef struct {
+    PageFetchKind kind;
+    PageJob *page;
+    char src[URL_MAX_LEN];
+    char error[CURL_ERROR_SIZE];
+    // Format sniffed from the first bytes, empty until they arrived
+    char ext[MAX_EXT_LEN];
+    // Why the probe gave up on the image
+    char rejected[128];
+    // Dimensions from the header, 0 if it could not be read
+    int w;
+    int h;
+    size_t cost;
+    // Size of the whole image according to the probe, 0 if unknown
+    size_t total;
+    // The server answered the probe with a part of the image
+    bool ranged;
+    // The probe got every byte of the image
+    bool probe_complete;
+    // Decoded from a data: URI rather than downloaded
+    bool inline_data;
+
+    // Guards the body and the flags below, which the download and the
+    // decode stage share
+    pthread_mutex_t lock;
+    FetchBody body;
+    // Bytes of the body the decoder has been given
+    size_t fed;
+    // A decode job for this image is queued or running
+    bool decoding;
+    bool downloaded;
+    bool over_budget;
+    bool download_failed;
+    bool decode_failed;
+
+    // Only touched by the decode job that is running
+    Decoder decoder;
+    size_t decode_order;
+    ImgData decoded;
+    // Formats still being encoded, guarded by the page's lock
+    size_t encodes_left;
+    ImgReport report;
+} ImgJob;
+
+// One target format of an image. Only reads the decoded pixels and only
+// writes its own entry of the report.
+typedef struct {
+    ImgJob *img;
+    int ext;
+} EncodeJob;
+
+// Decoding and encoding take time in proportion to the pixel count, which
+// the header gives away without decoding. Images whose header can't be read
+// count one pixel per byte.
+void img_job_estimate(ImgJob *job) {
+    if (decoder_info(job->body.ptr, job->body.len, job->ext, &job->w, &job->h)) {
+        job->cost = (size_t)job->w*job->h;
     } else {
-        dprintf(2, "ERROR: Don't know how to encode %s\n", out_format);
-        goto done;
+        job->w = job->h = 0;
+        job->cost = job->body.len;
     }
+}
 
-done:
-    return encoded_size;
+size_t decode_job_cost(void *job) {
+    return ((ImgJob*)job)->cost;
 }
 
-int next_img(char *src_buf, BufAndLen page, size_t max_src_len) {
-    int i = 0;
-    for (; strncmp(page.content+i, "<img ", 5) != 0; i++) {
-        if (i == page.len - 5) {
-            return 0;
-        }
+size_t encode_job_cost(void *void_job) {
+    EncodeJob *job = (EncodeJob*)void_job;
+    return job->img->cost*encode_costs[job->ext];
+}
+
+void page_job_finish(ImgJob *job, bool success) {
+    PageJob *page = job->page;
+    pthread_mutex_lock(&page->lock);
+    if (success) da_append(page->reports, &job->report);
+    if (--page->pending == 0) pthread_cond_signal(&page->done);
+    pthread_mutex_unlock(&page->lock);
+    free(job);
+}
+
+void encode_stage_job(void *ctx, void *void_job) {
+    Encoder *enc = (Encoder*)ctx;
+    EncodeJob *encode_job = (EncodeJob*)void_job;
+    ImgJob *job = encode_job->img;
+    int i = encode_job->ext;
+    if (config.debug) {
+        printf("DEBUG: %s: encoding %s to %s, cost %zu\n", job->page->url, job->src, extensions[i], encode_job_cost(encode_job));
+    }
+    free(encode_job);
+
+    Converted *converted = &job->report.extensions[i];
+    Sink sink;
+    // Room for about 4 bits per pixel, the sink grows if that's not enough
+    sink_memory(&sink, &encoded_pool, (size_t)job->decoded.w*job->decoded.h/2 + 4096);
+    size_t encoded_size = encode(&job->decoded, extensions[i], enc, &sink);
+    if (encoded_size > 0) {
+        Buf buf = sink_memory_take(&sink);
+        converted->data = (unsigned char*)buf.ptr;
+        converted->cap = buf.cap;
+        converted->size = encoded_size;
+    } else {
+        dprintf(2, "ERROR: Could not convert %s to %s\n", job->src, extensions[i]);
+        sink_memory_release(&sink);
+    }
+
+    pthread_mutex_lock(&job->page->lock);
+    bool last = --job->encodes_left == 0;
+    pthread_mutex_unlock(&job->page->lock);
+    if (!last) return;
+    img_data_free(&job->decoded);
+    page_job_finish(job, TRUE);
+}
+
+// Skipped images still get a report, with what the probe found out
+void img_job_skip(ImgJob *job, char *reason) {
+    printf("INFO: Skipping %s: %s\n", job->src, reason);
+    strcpy(job->report.src, job->src);
+    snprintf(job->report.skipped, sizeof(job->report.skipped), "%s", reason);
+    job->report.inline_data = job->inline_data;
+    job->report.w = job->w;
+    job->report.h = job->h;
+    job->report.size = job->total;
+    job->report.original_ext = EXTENSION_COUNT;
+    fetch_body_release(&job->body);
+    decoder_free(&job->decoder);
+    pthread_mutex_destroy(&job->lock);
+    page_job_finish(job, TRUE);
+}
+
+// Downloads of unknown size stopped by the report's budget are reported
+// like images skipped after probing
+void img_job_over_budget(ImgJob *job) {
+    char reason[128];
+    snprintf(reason, sizeof(reason), "went over the report's budget of %zu bytes", config.report_bytes);
+    img_job_skip(job, reason);
+}
+
+// Called by the last decode job of an image, once nothing else refers to it
+void img_job_decoded(ImgJob *job, bool success) {
+    if (job->over_budget) {
+        img_job_over_budget(job);
+        return;
     }
-    i += 5;
-    for (; strncmp(page.content+i, "src=\"", 5) != 0; i++) {
-        if (i == page.len - 5 || page.content[i] == '>') {
-            return 0;
+    if (success) success = decoder_finish(&job->decoder);
+    if (success) img_data_from_decoder(&job->decoded, &job->decoder);
+    decoder_free(&job->decoder);
+    pthread_mutex_destroy(&job->lock);
+    if (success) {
+        success = img_data_yuv(&job->decoded);
+        if (!success) img_data_free(&job->decoded);
+    }
+    if (!success) {
+        fetch_body_release(&job->body);
+        page_job_finish(job, FALSE);
+        return;
+    }
+    strcpy(job->report.src, job->src);
+    job->report.inline_data = job->inline_data;
+    job->report.original_ext = EXTENSION_COUNT;
+    for (int i = 0; i < EXTENSION_COUNT; i++) {
+        if (strcmp(job->ext, extensions[i]) == 0) {
+            job->report.extensions[i].size = job->body.len;
+            job->report.original_ext = i;
+            // There is no URL to link inline images to, so the report
+            // keeps them
+            if (job->inline_data) {
+                Buf buf = buf_pool_get(&encoded_pool, job->body.len);
+                if (buf.ptr != NULL) memcpy(buf.ptr, job->body.ptr, job->body.len);
+                job->report.extensions[i].data = (unsigned char*)buf.ptr;
+                job->report.extensions[i].cap = buf.cap;
+            }
         }
     }
-    i += 5;
-    int src_len = 0;
-    for (; i < page.len && page.content[i] != '"'; i++) {
-        if (strncmp(page.content+i, "amp;", 4) == 0) {
-            i += 3;
-            continue;
+    fetch_body_release(&job->body);
+    job->encodes_left = job->report.original_ext < EXTENSION_COUNT ? EXTENSION_COUNT - 1 : EXTENSION_COUNT;
+    for (int i = 0; i < EXTENSION_COUNT; i++) {
+        if (i == job->report.original_ext) continue;
+        EncodeJob *encode_job = malloc(sizeof(EncodeJob));
+        encode_job->img = job;
+        encode_job->ext = i;
+        pool_submit(&encode_stage, encode_job);
+    }
+}
+
+// Feeds the decoder whatever has been downloaded so far. Returns once it
+// caught up with a download that is still running, the next chunk queues
+// the image again.
+void decode_stage_job(void *ctx, void *void_job) {
+    char *chunk = (char*)ctx;
+    ImgJob *job = (ImgJob*)void_job;
+    if (config.debug && job->decode_order == 0) {
+        pthread_mutex_lock(&job->page->lock);
+        job->decode_order = ++job->page->decodes_started;
+        pthread_mutex_unlock(&job->page->lock);
+        printf("DEBUG: %s: decoding #%zu %s, %dx%d, cost %zu\n",
+            job->page->url, job->decode_order, job->src, job->w, job->h, job->cost);
+    }
+    // Once the download is over the body doesn't change any more, so an
+    // image nobody started on is decoded right from it
+    pthread_mutex_lock(&job->lock);
+    bool whole = job->downloaded && job->fed == 0 && !job->download_failed;
+    pthread_mutex_unlock(&job->lock);
+    if (whole) {
+        decoder_decode(&job->decoder, job->body.ptr, job->body.len);
+        img_job_decoded(job, TRUE);
+        return;
+    }
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        size_t len = job->body.len - job->fed;
+        if (len > DECODE_CHUNK) len = DECODE_CHUNK;
+        bool failed = job->decode_failed || job->download_failed;
+        if ((failed || len == 0) && !job->downloaded) {
+            job->decoding = FALSE;
+            pthread_mutex_unlock(&job->lock);
+            return;
+        }
+        if (failed || len == 0) {
+            pthread_mutex_unlock(&job->lock);
+            img_job_decoded(job, !failed);
+            return;
         }
-        if (src_len < max_src_len) {
-            src_buf[src_len++] = page.content[i];
+        memcpy(chunk, job->body.ptr + job->fed, len);
+        job->fed += len;
+        pthread_mutex_unlock(&job->lock);
+
+        if (!decoder_feed(&job->decoder, chunk, len)) {
+            pthread_mutex_lock(&job->lock);
+            job->decode_failed = TRUE;
+            pthread_mutex_unlock(&job->lock);
         }
     }
-    if (src_len > max_src_len) src_len = 0;
-    src_buf[src_len] = '\0';
-    return i;
 }
 
-// TODO check magic bytes or shit for extension recognition
-int guess_ext(char *src, size_t src_len, char *ext_buf) {
-    int ext_i = src_len-1;
-    
-    int has_ext = 1;
-    for (; src[ext_i-1] != '.'; ext_i--) {
-        if (ext_i == 1 || src[ext_i-1] == '/') {
-            has_ext = 0;
-            break;
-        }
+// Queues the image for decoding unless a decode job already has it. Called
+// with the image's lock held, returns whether the caller has to submit it.
+bool img_job_schedule(ImgJob *job) {
+    if (job->decoding) return FALSE;
+    job->decoding = TRUE;
+    img_job_estimate(job);
+    return TRUE;
+}
+
+// CURLOPT_WRITEFUNCTION for images. The first bytes go to the decoder right
+// away so a bad header stops the download early, later ones once a chunk
+// worth decoding has piled up. Blocks while the decode stage is full, which
+// also pauses the other downloads.
+size_t img_job_write(char *data, size_t one, size_t size, ImgJob *job) {
+    pthread_mutex_lock(&job->lock);
+    size_t written = 0;
+    if (job->total == 0 && size > job->page->budget) {
+        job->over_budget = TRUE;
+    } else if (!job->decode_failed) {
+        written = fetch_body_write(data, one, size, &job->body);
     }
+    if (job->total == 0) job->page->budget -= written;
+    bool submit = written > 0 && (job->fed == 0 || job->body.len - job->fed >= DECODE_CHUNK) && img_job_schedule(job);
+    pthread_mutex_unlock(&job->lock);
+    if (submit) pool_submit(&decode_stage, job);
+    return written;
+}
 
-    if (!has_ext) {
-        return 0;
+// Runs on the worker's thread as soon as a download finishes
+void img_fetch_done(Fetcher *fetcher, CURL *easy, CURLcode result, void *data) {
+    ImgJob *job = (ImgJob*)data;
+    fetcher_release(fetcher, easy);
+    pthread_mutex_lock(&job->lock);
+    job->downloaded = TRUE;
+    if (job->decode_failed) {
+        dprintf(2, "ERROR: Stopped downloading %s after %zu bytes, it can't be decoded\n", job->src, job->body.len);
+    } else if (job->body.too_big) {
+        dprintf(2, "ERROR: %s is bigger than %zu bytes\n", job->src, job->body.max);
+    } else if (result != CURLE_OK && !job->over_budget) {
+        dprintf(2, "ERROR: Could not get %s: %s (code %d)\n", job->src, job->error, result);
+    }
+    job->download_failed = result != CURLE_OK || job->body.len == 0;
+    if (config.debug) {
+        printf("DEBUG: %s: downloaded %s, %zu bytes, %dx%d, cost %zu\n", job->page->url, job->src, job->body.len, job->w, job->h, job->cost);
     }
-    size_t ext_len = 0;
-    for (; ext_i < src_len; ext_i++) ext_buf[ext_len++] = src[ext_i];
-    ext_buf[ext_len] = '\0';
-    return ext_len;
+    // A decode job that has the image ends it once it sees the failed
+    // download
+    if (job->over_budget && !job->decoding) {
+        pthread_mutex_unlock(&job->lock);
+        img_job_over_budget(job);
+        return;
+    }
+    bool submit = img_job_schedule(job);
+    pthread_mutex_unlock(&job->lock);
+    if (submit) pool_submit(&decode_stage, job);
 }
 
-bool generate_img_report(ImgReport *report, BufAndLen img, char *full_src) {
-    char ext[MAX_EXT_LEN];
-    char without_query[256];
-    if (!guess_ext(without_query, http_trim_query(full_src, without_query), ext)) {
-        printf("INFO: Could not guess extension of %s\n", full_src);
+// Tells the format from the first bytes, whatever the URL or the
+// Content-Type claim, and sets up its decoder. The Content-Type only helps
+// explain what the resource was when it can't be decoded, and is asked
+// from `easy` unless given.
+bool img_job_sniff(ImgJob *job, CURL *easy, char *content_type) {
+    char *format = decoder_sniff(job->body.ptr, job->body.len);
+    if (format == NULL) {
+        if (content_type == NULL && easy != NULL) curl_easy_getinfo(easy, CURLINFO_CONTENT_TYPE, &content_type);
+        if (content_type == NULL) content_type = "unknown content";
+        snprintf(job->rejected, sizeof(job->rejected), "%s is not a PNG, JPEG, WebP or AVIF image", content_type);
         return FALSE;
     }
-    
-    ImgData decoded;
-    decoded.pixels = decode_buf;
-    if (!decode(&decoded, ext, img)) {
+    strcpy(job->ext, format);
+    if (!decoder_init(&job->decoder, job->ext, config.max_pixels, &pixel_pool)) {
+        snprintf(job->rejected, sizeof(job->rejected), "no decoder for %s", format);
         return FALSE;
     }
-    
-    strcpy(report->src, full_src);
-    for (int i = 0; i < EXTENSION_COUNT; i++) {
-        char *out_ext = extensions[i];
-        if (strcmp(ext, out_ext) == 0) {
-            report->extensions[i].size = img.len;
-            report->original_ext = i;
-            continue;
-        }
-    
-        size_t encoded_size = encode(&decoded, out_ext, encode_buf);
-        report->extensions[i].size = encoded_size;
-        if (encoded_size > 0) {
-            report->extensions[i].b64_encoded = b64_encode((unsigned char*)encode_buf, encoded_size);
-        } else {
-            dprintf(2, "ERROR: Could not convert %s to %s\n", full_src, out_ext);
+    return TRUE;
+}
+
+// Probes never take more than the whole image may have
+size_t img_probe_bytes(FetchBody *body) {
+    return PROBE_BYTES < body->max ? PROBE_BYTES : body->max;
+}
+
+// CURLOPT_WRITEFUNCTION for probes. The transfer is aborted as soon as the
+// first bytes show the resource is not an image we can decode, and error
+// pages are not downloaded at all. Servers that ignore the range send the
+// whole image, which is cut off after PROBE_BYTES.
+size_t img_probe_write(char *data, size_t _one, size_t size, ImgJob *job) {
+    FetchBody *body = &job->body;
+    long status = 0;
+    curl_easy_getinfo(body->easy, CURLINFO_RESPONSE_CODE, &status);
+    if (status >= 400) return 0;
+    size_t probe_bytes = img_probe_bytes(body);
+    size_t take = size < probe_bytes - body->len ? size : probe_bytes - body->len;
+    if (take > 0) {
+        if (!fetch_body_reserve(body, probe_bytes)) return 0;
+        memcpy(body->ptr + body->len, data, take);
+        body->len += take;
+        body->ptr[body->len] = '\0';
+    }
+    if (job->ext[0] == '\0' && body->len >= DECODER_SNIFF_BYTES && !img_job_sniff(job, body->easy, NULL)) return 0;
+    return take == size ? size : 0;
+}
+
+// Finds out how big the whole image is from a probe's response
+size_t img_probe_total(CURL *easy, long status) {
+    if (status == 206) {
+        struct curl_header *range;
+        if (curl_easy_header(easy, "Content-Range", 0, CURLH_HEADER, -1, &range) != CURLHE_OK) return 0;
+        char *total = strrchr(range->value, '/');
+        return total != NULL ? strtoull(total+1, NULL, 10) : 0;
+    }
+    curl_off_t content_length = -1;
+    curl_easy_getinfo(easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+    return content_length > 0 ? content_length : 0;
+}
+
+// Probes are collected in `fetcher->ctx` until all of them are done, then
+// generate_page_reports decides which images to download
+void img_probe_done(Fetcher *fetcher, CURL *easy, CURLcode result, void *data) {
+    ImgJob *job = (ImgJob*)data;
+    DA *probed = (DA*)fetcher->ctx;
+    long status = 0;
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+    bool cut_off = result == CURLE_WRITE_ERROR && job->body.len == img_probe_bytes(&job->body);
+    if (result == CURLE_OK || cut_off) {
+        job->ranged = status == 206;
+        job->total = img_probe_total(easy, status);
+    }
+    if (job->rejected[0] == '\0' && job->ext[0] == '\0' && result == CURLE_OK && status < 400) {
+        img_job_sniff(job, easy, NULL);
+    }
+    fetcher_release(fetcher, easy);
+    if (status >= 400) {
+        dprintf(2, "ERROR: Could not get %s: HTTP status %ld\n", job->src, status);
+    } else if (job->rejected[0] != '\0') {
+        img_job_skip(job, job->rejected);
+        return;
+    } else if (result != CURLE_OK && !cut_off) {
+        dprintf(2, "ERROR: Could not get %s: %s (code %d)\n", job->src, job->error, result);
+    } else {
+        if (job->total == 0 && !cut_off && !job->ranged) job->total = job->body.len;
+        job->probe_complete = job->total == job->body.len && job->body.len > 0;
+        img_job_estimate(job);
+        if (config.debug) {
+            printf("DEBUG: %s: probed %s, HTTP %ld, %zu of %zu bytes, %dx%d\n",
+                job->page->url, job->src, status, job->body.len, job->total, job->w, job->h);
         }
+        da_append(probed, &job);
+        return;
+    }
+    img_job_decoded(job, FALSE);
+}
+
+// Images inlined as base64 data: URIs need no probe. They are decoded into
+// a body of their own, since the page's buffer still moves as it grows,
+// and join the probed images as if the probe had got all of them. Returns
+// FALSE for data: URIs that are not base64, which can't hold an image we
+// decode.
+bool img_job_inline(ImgJob *job, Fetcher *fetcher, BufAndLen value) {
+    char *comma = memchr(value.content, ',', value.len);
+    if (comma == NULL || comma - value.content < 12 || strncasecmp(comma - 7, ";base64", 7) != 0) return FALSE;
+    char *media_end = memchr(value.content, ';', comma - value.content);
+    char media_type[64];
+    snprintf(media_type, sizeof(media_type), "%.*s", (int)(media_end - value.content - 5), value.content + 5);
+    char *data = comma + 1;
+    size_t data_len = value.content + value.len - data;
+    fetch_body_init(&job->body, fetcher, NULL, b64_decoded_size(data_len));
+    if (!fetch_body_reserve(&job->body, b64_decoded_size(data_len))) return FALSE;
+    size_t size = b64_decode_to(data, data_len, (unsigned char*)job->body.ptr);
+    if (size == B64_INVALID) {
+        dprintf(2, "ERROR: Inline %s image is not valid base64\n", media_type);
+        fetch_body_release(&job->body);
+        return FALSE;
     }
+    snprintf(job->src, sizeof(job->src), "data:%s (%zu bytes inline)", media_type, size);
+    job->inline_data = TRUE;
+    job->body.len = size;
+    job->total = size;
+    job->probe_complete = TRUE;
+    if (img_job_sniff(job, NULL, media_type)) img_job_estimate(job);
     return TRUE;
 }
 
-void get_full_src(char *full_src, char *src, char *host) {
-    strcpy(full_src, src);
-    if (!has_protocol_prefix(src)) {
-        if (src[0] != '/') {
-            strcpy(full_src+strlen(host)+1, src);
-            full_src[strlen(host)] = '/';
-        } else {
-            strcpy(full_src+strlen(host), src);
-        }
-        strncpy(full_src, host, strlen(host));
+int img_job_cmp_cost(const void *a, const void *b) {
+    size_t a_cost = (*(ImgJob**)a)->cost;
+    size_t b_cost = (*(ImgJob**)b)->cost;
+    return a_cost < b_cost ? 1 : a_cost > b_cost ? -1 : 0;
+}
+
+// Downloads the rest of a probed image, or hands it straight to the decode
+// stage when the probe already got all of it
+void img_job_fetch(Fetcher *fetcher, ImgJob *job) {
+    if (job->probe_complete) {
+        job->downloaded = TRUE;
+        job->decoding = TRUE;
+        pool_submit(&decode_stage, job);
+        return;
     }
+    CURL *easy = curl_easy_for(fetcher, job->src, CURL_IMG_TIMEOUT, img_job_write, job, job->error);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, job);
+    job->body.easy = easy;
+    if (job->ranged) {
+        char range[32];
+        sprintf(range, "%zu-", job->body.len);
+        curl_easy_setopt(easy, CURLOPT_RANGE, range);
+    } else {
+        job->body.len = 0;
+    }
+    if (job->total > 0) fetch_body_reserve(&job->body, job->total);
+    fetcher_add(fetcher, easy);
+}
+
+bool stages_start() {
+    size_t decode_threads = config.decode_threads > 0 ? config.decode_threads : pool_cpu_count();
+    size_t encode_threads = config.encode_threads > 0 ? config.encode_threads : pool_cpu_count();
+    void **decode_chunks = malloc(decode_threads*sizeof(void*));
+    for (size_t i = 0; i < decode_threads; i++) decode_chunks[i] = malloc(DECODE_CHUNK);
+    EncoderSettings settings;
+    encoder_settings(&settings);
+    void **encoders = malloc(encode_threads*sizeof(void*));
+    for (size_t i = 0; i < encode_threads; i++) {
+        encoders[i] = malloc(sizeof(Encoder));
+        if (!encoder_init(encoders[i], ENCODE_WINDOW, &settings)) return FALSE;
+    }
+    if (!pool_start(&decode_stage, decode_threads, decode_threads*JOBS_PER_STAGE_THREAD, decode_stage_job, decode_chunks, decode_job_cost)) return FALSE;
+    if (!pool_start(&encode_stage, encode_threads, encode_threads*JOBS_PER_STAGE_THREAD, encode_stage_job, encoders, encode_job_cost)) return FALSE;
+    printf("INFO: Started %zu decode and %zu encode threads\n", decode_threads, encode_threads);
+    return TRUE;
 }
 
+// The page's download, and what the images found in it need to be queued
 typedef struct {
-    pthread_t pthread;
-    char src[URL_MAX_LEN];
-    BufAndLen buf;
-} CurlThreadArg;
+    PageFetchKind kind;
+    FetchBody body;
+    char error[CURL_ERROR_SIZE];
+    // Runs over the page as it arrives
+    HtmlScanner scanner;
+    PageJob *page;
+    Fetcher *fetcher;
+    // The page's URL, which its own references are relative to
+    char *base;
+    DA *probed;
+    // Hashes of the URLs queued so far, the same image tends to be in both
+    // src and srcset or in a lazy loading attribute and <noscript>
+    DA seen;
+    // Stylesheets followed and the CSS downloaded so far, which all
+    // stylesheets of the page share a budget for
+    size_t styles;
+    size_t css_bytes;
+} PageScan;
+
+// Where the url() of a piece of CSS are relative to, and how many
+// stylesheets deep it is
+typedef struct {
+    PageScan *scan;
+    char *base;
+    size_t depth;
+} CssSource;
+
+typedef struct {
+    PageFetchKind kind;
+    CssSource source;
+    char url[URL_MAX_LEN];
+    char error[CURL_ERROR_SIZE];
+    FetchBody body;
+    bool over_budget;
+} StyleJob;
 
-void *img_report_pthread(void *void_arg) {
-    CurlThreadArg *arg = (CurlThreadArg*)void_arg;
-    arg->buf.content = malloc(FILE_BUF_SIZE);
-    curl(&arg->buf, arg->src, CURL_IMG_TIMEOUT);
-    return void_arg;
+void style_job_free(StyleJob *job) {
+    fetch_body_release(&job->body);
+    free(job);
 }
 
-void join_threads(DA *reports, DA pthread_da) {
-    for (int i = 0; i < pthread_da.len; i++) {
-        CurlThreadArg *pthread = (CurlThreadArg*)da_at(pthread_da, i);
-        pthread_join(pthread->pthread, NULL);
-        if (pthread->buf.len < 1) {
-            continue;
+// Returns whether `key` was not seen on the page before, and remembers it
+bool page_scan_first(PageScan *scan, char *key, size_t len) {
+    uint64_t hash = html_hash(key, len);
+    for (size_t i = 0; i < scan->seen.len; i++) {
+        if (((uint64_t*)scan->seen.ptr)[i] == hash) return FALSE;
+    }
+    da_append(&scan->seen, &hash);
+    return TRUE;
+}
+
+// Resolves a reference against `base` into `full_src`. References from
+// HTML have their character references decoded first, those from CSS are
+// taken as they are. False if it doesn't fit or was queued before.
+bool page_scan_resolve(PageScan *scan, char *full_src, char *ref, size_t ref_len, bool html, char *base) {
+    char src[URL_MAX_LEN];
+    size_t src_len = 0;
+    if (html) {
+        src_len = html_copy_url(src, sizeof(src), ref, ref_len);
+    } else if (ref_len < sizeof(src)) {
+        memcpy(src, ref, ref_len);
+        src[ref_len] = '\0';
+        src_len = ref_len;
+    }
+    if (src_len == 0 || !http_resolve_url(full_src, URL_MAX_LEN, base, src)) {
+        dprintf(2, "ERROR: Skipping a URL longer than %d bytes\n", URL_MAX_LEN);
+        return FALSE;
+    }
+    return page_scan_first(scan, full_src, strlen(full_src));
+}
+
+// Inline images are taken from the buffer they are in right away, the
+// others get a probe
+void page_scan_image(PageScan *scan, char *url, size_t url_len, bool html, char *base) {
+    bool inline_data = url_len > 5 && strncasecmp(url, "data:", 5) == 0;
+    char full_src[URL_MAX_LEN];
+    if (inline_data) {
+        if (!page_scan_first(scan, url, url_len)) return;
+    } else if (!page_scan_resolve(scan, full_src, url, url_len, html, base)) {
+        return;
+    }
+    ImgJob *job = calloc(1, sizeof(ImgJob));
+    job->kind = PAGE_FETCH_IMAGE;
+    job->page = scan->page;
+    pthread_mutex_init(&job->lock, NULL);
+    if (inline_data) {
+        BufAndLen value = {.content = url, .len = url_len};
+        if (!img_job_inline(job, scan->fetcher, value)) {
+            pthread_mutex_destroy(&job->lock);
+            free(job);
+            return;
         }
-    
-        ImgReport *report = da_at(*reports, reports->len);
-        bool success = generate_img_report(report, pthread->buf, pthread->src);
-        free(pthread->buf.content);
-        if (!success) continue;
-        da_append(reports, report);
+        printf("INFO: Processing %s\n", job->src);
+        pthread_mutex_lock(&scan->page->lock);
+        scan->page->pending++;
+        pthread_mutex_unlock(&scan->page->lock);
+        if (job->rejected[0] != '\0') img_job_skip(job, job->rejected);
+        else da_append(scan->probed, &job);
+        return;
     }
+    printf("INFO: Processing %s\n", full_src);
+    strcpy(job->src, full_src);
+    Fetcher *fetcher = scan->fetcher;
+    CURL *easy = curl_easy_for(fetcher, job->src, CURL_IMG_TIMEOUT, img_probe_write, job, job->error);
+    fetch_body_init(&job->body, fetcher, easy, config.max_image_bytes);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, job);
+    char range[32];
+    sprintf(range, "0-%d", PROBE_BYTES - 1);
+    curl_easy_setopt(easy, CURLOPT_RANGE, range);
+    pthread_mutex_lock(&scan->page->lock);
+    scan->page->pending++;
+    pthread_mutex_unlock(&scan->page->lock);
+    fetcher_add(fetcher, easy);
 }
 
-bool generate_page_reports(char *input_url, DA *reports, int use_prerender) {
-    char host[32] = {0};
-    char *protocol;
-    if (has_http_prefix(input_url)) protocol = "http://";
-    else protocol = "https://";
-    strcpy(host, protocol);
-    for (int i = strlen(protocol); i < strlen(input_url) && input_url[i] != '/'; i++) {
-        host[i] = input_url[i];
+// CURLOPT_WRITEFUNCTION for stylesheets, which share the page's CSS budget.
+// Error pages are not downloaded at all.
+size_t style_job_write(char *data, size_t one, size_t size, StyleJob *job) {
+    PageScan *scan = job->source.scan;
+    long status = 0;
+    curl_easy_getinfo(job->body.easy, CURLINFO_RESPONSE_CODE, &status);
+    if (status >= 400) return 0;
+    if (scan->css_bytes + size > config.css_bytes) {
+        job->over_budget = TRUE;
+        return 0;
     }
-    
-    char request_url[256] = {0};
-    if (use_prerender){
-        printf("INFO: Using prerender for %s\n", input_url);
-        strcpy(request_url, PRERENDER);
+    size_t written = fetch_body_write(data, one, size, &job->body);
+    scan->css_bytes += written;
+    return written;
+}
+
+// Downloads a stylesheet alongside the probes, unless it is too deep or
+// the page's CSS budget is spent
+void page_scan_stylesheet(PageScan *scan, char *ref, size_t ref_len, bool html, char *base, size_t depth) {
+    if (depth > config.css_depth) {
+        if (config.debug) printf("DEBUG: %s: not following %.*s, %zu stylesheets deep\n", scan->page->url, (int)ref_len, ref, depth);
+        return;
     }
-    strcpy(request_url+strlen(request_url), input_url);
-    
-    BufAndLen page = {0};
-    page.content = webpage_buf;
-    if (curl(&page, request_url, CURL_PAGE_TIMEOUT) < 1) {
-        dprintf(2, "ERROR: Could not get page %s\n", request_url);
+    StyleJob *job = calloc(1, sizeof(StyleJob));
+    if (!page_scan_resolve(scan, job->url, ref, ref_len, html, base)) {
+        free(job);
+        return;
+    }
+    if (scan->css_bytes >= config.css_bytes) {
+        printf("INFO: Skipping stylesheet %s: the report's stylesheets are over %zu bytes\n", job->url, config.css_bytes);
+        free(job);
+        return;
+    }
+    printf("INFO: Following stylesheet %s\n", job->url);
+    job->kind = PAGE_FETCH_STYLESHEET;
+    job->source.scan = scan;
+    job->source.base = job->url;
+    job->source.depth = depth;
+    CURL *easy = curl_easy_for(scan->fetcher, job->url, CURL_IMG_TIMEOUT, style_job_write, job, job->error);
+    curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+    fetch_body_init(&job->body, scan->fetcher, easy, config.css_bytes);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, job);
+    scan->styles++;
+    fetcher_add(scan->fetcher, easy);
+}
+
+// Called by the CSS scanner for every url() and @import
+void page_scan_css(CssRef *ref, void *ctx) {
+    CssSource *source = (CssSource*)ctx;
+    PageScan *scan = source->scan;
+    if (config.debug) {
+        printf("DEBUG: %s: %s in %s: %.*s\n", scan->page->url, ref->import ? "@import" : "url()", source->base,
+            (int)(ref->url_len < 100 ? ref->url_len : 100), ref->url);
+    }
+    if (ref->import) page_scan_stylesheet(scan, ref->url, ref->url_len, FALSE, source->base, source->depth + 1);
+    else page_scan_image(scan, ref->url, ref->url_len, FALSE, source->base);
+}
+
+// Scans a stylesheet as soon as it is downloaded, so the images in it are
+// probed while the other transfers of the first phase are still running.
+// Stylesheets that were cut off are dropped, they might end in the middle
+// of a URL.
+void style_job_done(Fetcher *fetcher, CURL *easy, CURLcode result, StyleJob *job) {
+    long status = 0;
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+    fetcher_release(fetcher, easy);
+    if (status >= 400) {
+        dprintf(2, "ERROR: Could not get %s: HTTP status %ld\n", job->url, status);
+    } else if (job->over_budget) {
+        dprintf(2, "ERROR: Stopped downloading %s, the report's stylesheets are over %zu bytes\n", job->url, config.css_bytes);
+    } else if (result != CURLE_OK) {
+        dprintf(2, "ERROR: Could not get %s: %s (code %d)\n", job->url, job->error, result);
+    } else {
+        css_scan(job->body.ptr, job->body.len, page_scan_css, &job->source);
+    }
+    style_job_free(job);
+}
+
+// Called by the HTML scanner for every image and stylesheet candidate
+void page_scan_found(HtmlImage *image, void *ctx) {
+    PageScan *scan = (PageScan*)ctx;
+    if (config.debug) {
+        printf("DEBUG: %s: <%s %s> %.*s %.*s\n", scan->page->url, image->tag, image->attr,
+            (int)(image->url_len < 100 ? image->url_len : 100), image->url, (int)image->descriptor_len, image->descriptor);
+    }
+    if (image->stylesheet) page_scan_stylesheet(scan, image->url, image->url_len, TRUE, scan->base, 1);
+    else page_scan_image(scan, image->url, image->url_len, TRUE, scan->base);
+}
+
+// Called by the HTML scanner with the content of each <style> element
+void page_scan_style(char *css, size_t len, void *ctx) {
+    PageScan *scan = (PageScan*)ctx;
+    CssSource source = {.scan = scan, .base = scan->base, .depth = 0};
+    css_scan(css, len, page_scan_css, &source);
+}
+
+// CURLOPT_WRITEFUNCTION for the page. Every piece is scanned as it arrives,
+// so the images and stylesheets near the top are on their way while the
+// rest of the page is still coming in. Error pages are not downloaded.
+size_t page_scan_write(char *data, size_t one, size_t size, PageScan *scan) {
+    long status = 0;
+    curl_easy_getinfo(scan->body.easy, CURLINFO_RESPONSE_CODE, &status);
+    if (status >= 400) return 0;
+    size_t written = fetch_body_write(data, one, size, &scan->body);
+    if (written > 0) html_scan(&scan->scanner, scan->body.ptr, scan->body.len, FALSE);
+    return written;
+}
+
+// A page that broke off halfway still has its images reported, as far as
+// it got
+void page_scan_done(Fetcher *fetcher, CURL *easy, CURLcode result, PageScan *scan) {
+    long status = 0;
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+    fetcher_release(fetcher, easy);
+    if (status >= 400) {
+        dprintf(2, "ERROR: Could not get %s: HTTP status %ld\n", scan->page->url, status);
+    } else if (scan->body.too_big) {
+        dprintf(2, "ERROR: %s is bigger than %zu bytes, only the start is scanned\n", scan->page->url, scan->body.max);
+    } else if (result != CURLE_OK) {
+        dprintf(2, "ERROR: Could not get all of %s: %s (code %d)\n", scan->page->url, scan->error, result);
+    }
+    html_scan(&scan->scanner, scan->body.ptr, scan->body.len, TRUE);
+}
+
+void page_fetch_done(Fetcher *fetcher, CURL *easy, CURLcode result, void *data) {
+    PageFetchKind kind = *(PageFetchKind*)data;
+    if (kind == PAGE_FETCH_HTML) page_scan_done(fetcher, easy, result, (PageScan*)data);
+    else if (kind == PAGE_FETCH_STYLESHEET) style_job_done(fetcher, easy, result, (StyleJob*)data);
+    else img_probe_done(fetcher, easy, result, data);
+}
+
+bool generate_page_reports(Worker *worker, char *input_url, DA *reports, FetchStats *stats, int use_prerender) {
+    // Room for the longest `page` the query can hold
+    char request_url[sizeof(PRERENDER) + HTTP_KV_LEN];
+    if (use_prerender) printf("INFO: Using prerender for %s\n", input_url);
+    if (snprintf(request_url, sizeof(request_url), "%s%s", use_prerender ? PRERENDER : "", input_url) >= sizeof(request_url)) {
+        dprintf(2, "ERROR: Page URL %s is too long\n", input_url);
         return FALSE;
     }
-    page.content[page.len] = 0;
-    char src[URL_MAX_LEN];
-    int offset = 0;
     
-    DA pthread_da;
-    da_alloc(&pthread_da, INITIAL_REPORTS, sizeof(CurlThreadArg));
+    Fetcher *fetcher = &worker->fetcher;
+    memset(&fetcher->stats, 0, sizeof(FetchStats));
+    PageJob page_job = {.reports = reports, .pending = 0, .url = input_url};
+    pthread_mutex_init(&page_job.lock, NULL);
+    pthread_cond_init(&page_job.done, NULL);
+    DA probed;
+    da_alloc(&probed, INITIAL_REPORTS, sizeof(ImgJob*));
+    fetcher->done = page_fetch_done;
+    fetcher->ctx = &probed;
     
-    for (int iter = 0; iter < 1000; iter++) {
-        offset = next_img(src, page, URL_MAX_LEN);
-        page.content += offset;
-        page.len -= offset;
-        if (offset == 0) {
-            break;
-        }
-
-        if (strncmp(src, "data:", 5) == 0) {
-            continue;
-        }
-        char full_src[256];
-        get_full_src(full_src, src, host);
-        printf("INFO: Processing %s\n", full_src);
-        
-        CurlThreadArg *pthread = da_at(pthread_da, pthread_da.len);
-        strcpy(pthread->src, full_src);
-        if (pthread_create(&pthread->pthread, NULL, img_report_pthread, (void*)pthread) != 0) {
-            dprintf(2, "ERROR: Could not create pthread\n");
-            exit(1);
-        }
-        da_append(&pthread_da, pthread);
-        
-        if (pthread_da.len == MAX_CURL_THREADS) {
-            join_threads(reports, pthread_da);
-            da_reset(&pthread_da);
+    PageScan scan = {.kind = PAGE_FETCH_HTML, .page = &page_job, .fetcher = fetcher, .base = input_url, .probed = &probed};
+    da_alloc(&scan.seen, INITIAL_REPORTS, sizeof(uint64_t));
+    html_scanner_init(&scan.scanner, page_scan_found, page_scan_style, &scan);
+    CURL *easy = curl_easy_for(fetcher, request_url, CURL_PAGE_TIMEOUT, page_scan_write, &scan, scan.error);
+    curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, &scan);
+    fetch_body_init(&scan.body, fetcher, easy, config.page_bytes > 0 ? config.page_bytes : FETCH_BODY_UNLIMITED);
+    fetcher_add(fetcher, easy);
+    // The page, its probes and its stylesheets all run here, the probes
+    // starting as soon as the scanner finds their images. Once all of them
+    // are in, the images within the limits are downloaded, largest first.
+    fetcher_run(fetcher);
+    da_free(&scan.seen);
+    size_t page_len = scan.body.len;
+    fetch_body_release(&scan.body);
+    if (page_len == 0) dprintf(2, "ERROR: Could not get page %s\n", request_url);
+    if (config.debug) {
+        printf("DEBUG: %s: %zu bytes, %zu image candidates in the page, %zu stylesheets with %zu bytes\n",
+            input_url, page_len, scan.scanner.images, scan.styles, scan.css_bytes);
+    }
+    qsort(probed.ptr, probed.len, sizeof(ImgJob*), img_job_cmp_cost);
+    fetcher->done = img_fetch_done;
+    page_job.budget = config.report_bytes;
+    for (size_t i = 0; i < probed.len; i++) {
+        ImgJob *job = ((ImgJob**)probed.ptr)[i];
+        // Images of unknown size are charged the bytes a ranged probe got
+        // here and the rest in img_job_write, those downloaded again from
+        // the start only there
+        size_t charge = job->total > 0 ? job->total : job->ranged ? job->body.len : 0;
+        char reason[128];
+        if ((uint64_t)job->w*(uint64_t)job->h > config.max_pixels) {
+            snprintf(reason, sizeof(reason), "%dx%d is more than %zu pixels", job->w, job->h, config.max_pixels);
+            img_job_skip(job, reason);
+        } else if (job->total > config.max_image_bytes) {
+            snprintf(reason, sizeof(reason), "bigger than %zu bytes", config.max_image_bytes);
+            img_job_skip(job, reason);
+        } else if (!job->inline_data && charge > page_job.budget) {
+            snprintf(reason, sizeof(reason), "would go over the report's budget of %zu bytes", config.report_bytes);
+            img_job_skip(job, reason);
+        } else {
+            // Inline images are already here
+            if (!job->inline_data) page_job.budget -= charge;
+            img_job_fetch(fetcher, job);
         }
     }
-    join_threads(reports, pthread_da);
-    da_free(&pthread_da);
-    return TRUE;
+    da_free(&probed);
+    fetcher_run(fetcher);
+    pthread_mutex_lock(&page_job.lock);
+    while (page_job.pending > 0) pthread_cond_wait(&page_job.done, &page_job.lock);
+    pthread_mutex_unlock(&page_job.lock);
+    pthread_mutex_destroy(&page_job.lock);
+    pthread_cond_destroy(&page_job.done);
+    *stats = fetcher->stats;
+    printf("INFO: %zu transfers for %s: %zu over reused connections, %zu new connections, %zu over HTTP/2\n",
+        stats->transfers, input_url, stats->reused, stats->new_connections, stats->http2);
+    return page_len > 0;
 }
 
 int get_bytes_str(size_t bytes, char *buf) {
@@ -497,33 +1153,37 @@ int get_bytes_str(size_t bytes, char *buf) {
     return sprintf(buf, "%.2f MB", bytes/1024.f/1024);
 }
 
-bool serve_report(HttpReq *request, HttpResp *response, int clientfd) {
-    char input_url[128];
+bool serve_report(Worker *worker, HttpReq *request, HttpResp *response, HttpConn *conn) {
+    char input_url[HTTP_KV_LEN];
     if (!http_get_query_param(request, "page", input_url)) {
         dprintf(2, "ERROR: No `page` provided\n");
-        http_not_found(clientfd);
         return FALSE;
     }
-    char use_prerender_req[2];
+    char use_prerender_req[HTTP_KV_LEN] = {0};
     http_get_query_param(request, "prerender", use_prerender_req);
     int use_prerender = 0;
     if (strcmp(use_prerender_req, "1") == 0) use_prerender = 1;
     printf("INFO: Will try to handle %s\n", input_url);
     if (!has_protocol_prefix(input_url)) {
-        http_not_found(clientfd);
         dprintf(2, "ERROR: %s is not a web page address\n", input_url);
         return FALSE;
     }
     
     DA reports_da;
-    ImgReport *reports = da_alloc(&reports_da, INITIAL_REPORTS, sizeof(ImgReport));
-    bool success = generate_page_reports(input_url, &reports_da, use_prerender);
+    da_alloc(&reports_da, INITIAL_REPORTS, sizeof(ImgReport));
+    FetchStats stats;
+    bool success = generate_page_reports(worker, input_url, &reports_da, &stats, use_prerender);
     if (!success) {
+        da_free(&reports_da);
         return FALSE;
     }
+    ImgReport *reports = reports_da.ptr;
     printf("INFO: Generated %zu image reports for %s\n", reports_da.len, input_url);
     
-    response->body.len = sprintf(response->body.ptr, "<table>");
+    response->body.len = 0;
+    http_body_appendf(&response->body, "<p>%zu downloads over %zu connections, %zu reused a connection, %zu used HTTP/2</p>",
+        stats.transfers, stats.new_connections, stats.reused, stats.http2);
+    http_body_appendf(&response->body, "<table>");
     for (int ext = 0; ext < EXTENSION_COUNT; ext++) {
         size_t total = 0;
         for (size_t i = 0; i < reports_da.len; i++) {
@@ -539,6 +1199,18 @@ bool serve_report(HttpReq *request, HttpResp *response, int clientfd) {
         for (int ext = 0; ext < EXTENSION_COUNT; ext++) {
             if (reports[i].extensions[ext].size > 0 && reports[i].original_ext != ext) success = 1;
         }
+        if (reports[i].skipped[0] != '\0') {
+            char bytes_str[32] = "unknown size";
+            if (reports[i].size > 0) get_bytes_str(reports[i].size, bytes_str);
+            if (reports[i].inline_data) {
+                http_body_appendf(&response->body, "<td colspan=\"%d\">%s<br>%dx%d, %s, skipped: %s</td></tr>",
+                    EXTENSION_COUNT, reports[i].src, reports[i].w, reports[i].h, bytes_str, reports[i].skipped);
+                continue;
+            }
+            http_body_appendf(&response->body, "<td colspan=\"%d\"><a target=\"_blank\" href=\"%s\">%s</a><br>%dx%d, %s, skipped: %s</td></tr>",
+                EXTENSION_COUNT, reports[i].src, reports[i].src, reports[i].w, reports[i].h, bytes_str, reports[i].skipped);
+            continue;
+        }
         if (!success) continue;
         for (int ext = 0; ext < EXTENSION_COUNT; ext++) {
             char *img_style = "";
@@ -548,24 +1220,25 @@ bool serve_report(HttpReq *request, HttpResp *response, int clientfd) {
                 size_suf = " (original)";
             }
             
-            http_body_appendf(&response->body, "<td><a target=\"_blank\" href=\"", img_style);
-            if (reports[i].original_ext == ext) http_body_appendf(&response->body, "%s", reports[i].src);
-            else http_body_appendf(&response->body, "http://localhost:%d/convert/%s/%s", PORT, extensions[ext], reports[i].src);
+            http_body_appendf(&response->body, "<td><a target=\"_blank\"");
+            if (reports[i].inline_data) {
+                // Neither the original nor /convert can be linked to
+            } else if (reports[i].original_ext == ext) {
+                http_body_appendf(&response->body, " href=\"%s\"", reports[i].src);
+            } else {
+                http_body_appendf(&response->body, " href=\"http://localhost:%d/convert/%s/%s\"", PORT, extensions[ext], reports[i].src);
+            }
             
-            http_body_appendf(&response->body, "\"><img style=\"%s\" src=\"", img_style);
-            if (reports[i].original_ext == ext) {
+            http_body_appendf(&response->body, "><img style=\"%s\" src=\"", img_style);
+            Converted *converted = &reports[i].extensions[ext];
+            if (converted->data != NULL) {
+                http_body_appendf(&response->body, "data:image/%s;base64,", extensions[ext]);
+                http_body_append_b64(&response->body, converted->data, converted->size);
+            } else if (reports[i].original_ext == ext) {
                 http_body_appendf(&response->body, "%s", reports[i].src);
             } else {
-                char *b64;
-                char *report_ext;
-                if (reports[i].extensions[ext].size) {
-                    b64 = reports[i].extensions[ext].b64_encoded;
-                    report_ext = extensions[ext];
-                } else {
-                    b64 = UNAVAILABLE_B64;
-                    report_ext = UNAVAILABLE_B64_EXT;
-                }
-                http_body_appendf(&response->body, "data:image/%s;base64,%s", report_ext, b64);
+                http_body_appendf(&response->body, "data:image/%s;base64,", UNAVAILABLE_B64_EXT);
+                http_body_append(&response->body, UNAVAILABLE_B64, sizeof(UNAVAILABLE_B64) - 1);
             }
             char bytes_str[32];
             get_bytes_str(reports[i].extensions[ext].size, bytes_str);
@@ -575,16 +1248,19 @@ bool serve_report(HttpReq *request, HttpResp *response, int clientfd) {
     }
     http_body_appendf(&response->body, "</table>");
   
+    for (size_t i = 0; i < reports_da.len; i++) {
+        for (int ext = 0; ext < EXTENSION_COUNT; ext++) converted_free(&reports[i].extensions[ext]);
+    }
     da_free(&reports_da);
     strcpy(response->headers[0].k, "Access-Control-Allow-Origin");
     strcpy(response->headers[0].v, "*");
     response->headers_count++;
     
-    http_respond(clientfd, 200, response);
+    http_respond(conn, 200, response);
     return TRUE;
 }
 
-bool serve_static_file(HttpReq *request, HttpResp *response, int clientfd) {
+bool serve_static_file(HttpReq *request, HttpResp *response, HttpConn *conn) {
     char *path = &request->path[1];
     if (strlen(path) == 0) {
         path = "index.html";
@@ -592,59 +1268,131 @@ bool serve_static_file(HttpReq *request, HttpResp *response, int clientfd) {
     
     int fd = open(path, O_RDONLY);
     if (fd < 0) return FALSE;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return FALSE;
+    }
     
-    int size = read(fd, file_buf, FILE_BUF_SIZE);
+    // Served on the event loop thread, which has no worker buffers
+    response->body.ptr = malloc(st.st_size);
+    int size = read(fd, response->body.ptr, st.st_size);
     close(fd);
-    if (size < 0) return FALSE;
-    
-    response->body.ptr = file_buf;
+    if (size < 0) {
+        free(response->body.ptr);
+        return FALSE;
+    }
     response->body.len = size;
     
-    http_respond(clientfd, 200, response);
+    http_respond(conn, 200, response);
+    free(response->body.ptr);
     return TRUE;
 }
 
 #define CONVERT_PATH "/convert/"
 
-size_t encode_by_url(char *src, char *ext, char *encode_buf) {
-    char in_ext[MAX_EXT_LEN];
-    char without_query[256];
-    if (!guess_ext(without_query, http_trim_query(src, without_query), in_ext)) {
-        printf("INFO: Could not guess extension of %s\n", src);
+size_t encode_by_url(Worker *worker, char *src, char *ext, Sink *out) {
+    FetchBody body;
+    printf("INFO: Getting %s\n", src);
+    if (curl(&worker->fetcher, &body, src, CURL_IMG_TIMEOUT, config.max_image_bytes) < 1) return 0;
+    char *in_ext = decoder_sniff(body.ptr, body.len);
+    if (in_ext == NULL) {
+        dprintf(2, "ERROR: %s is not a PNG, JPEG, WebP or AVIF image\n", src);
+        fetch_body_release(&body);
         return 0;
     }
-    BufAndLen img = {0};
-    img.content = file_buf;
-    printf("INFO: Getting %s\n", src);
-    if (curl(&img, src, CURL_IMG_TIMEOUT) < 1) return 0;
     printf("INFO: Encoding %s\n", src);
     ImgData decoded;
-    decoded.pixels = decode_buf;
-    if (!decode(&decoded, in_ext, img)) return 0;
-    return encode(&decoded, ext, encode_buf);
+    BufAndLen img = {.content = body.ptr, .len = body.len};
+    bool decoded_ok = decode(&decoded, in_ext, img);
+    fetch_body_release(&body);
+    if (!decoded_ok) return 0;
+    size_t size = encode(&decoded, ext, &worker->encoder, out);
+    img_data_free(&decoded);
+    return size;
 }
 
-bool serve_convert(HttpReq *request, HttpResp *response, int clientfd) {
+bool serve_convert(Worker *worker, HttpReq *request, HttpResp *response, HttpConn *conn) {
     char ext[MAX_EXT_LEN];
     char *url_ext = &request->url[strlen(CONVERT_PATH)];
     int path_len = strlen(url_ext);
     int i = 0;
-    for (;i < MAX_EXT_LEN && url_ext[i] != '/' && i < path_len; i++) {
+    for (;i < MAX_EXT_LEN - 1 && url_ext[i] != '/' && i < path_len; i++) {
         ext[i] = url_ext[i];
     }
+    if (url_ext[i] != '/') {
+        dprintf(2, "ERROR: No format to convert to in %s\n", request->url);
+        return FALSE;
+    }
     ext[i++] = 0;
     char *src = &url_ext[i];
-    size_t size = encode_by_url(src, ext, encode_buf);
-    if (size < 1) return FALSE;
-    strcpy(response->headers[response->headers_count++].k, "Content-Type");
+    Sink sink;
+    sink_memory(&sink, &encoded_pool, ENCODED_SIZE_HINT);
+    size_t size = encode_by_url(worker, src, ext, &sink);
+    if (size < 1) {
+        sink_memory_release(&sink);
+        return FALSE;
+    }
+    strcpy(response->headers[response->headers_count].k, "Content-Type");
     strcpy(response->headers[response->headers_count].v, "image/");
-    strcpy(response->headers[response->headers_count].v, ext);
-    response->body.ptr = encode_buf;
+    strcat(response->headers[response->headers_count++].v, ext);
+    response->body.ptr = sink.ptr;
     response->body.len = size;
-    http_respond(clientfd, 200, response);
+    http_respond(conn, 200, response);
+    sink_memory_release(&sink);
     return TRUE;
 }
 
+typedef struct {
+    HttpServer *server;
+    HttpConn *conn;
+} PipelineJob;
+
+static Pool workers;
+
+void pipeline_job(void *ctx, void *void_job) {
+    Worker *worker = (Worker*)ctx;
+    PipelineJob *job = (PipelineJob*)void_job;
+    HttpReq *request = &job->conn->request;
+    HttpResp response = {0};
+    
+    bool success;
+    if (strcmp(request->path, "/report") == 0) {
+        response.body.cap = WEBPAGE_BUF_SIZE;
+        response.body.ptr = malloc(response.body.cap);
+        success = serve_report(worker, request, &response, job->conn);
+        free(response.body.ptr);
+    } else {
+        success = serve_convert(worker, request, &response, job->conn);
+    }
+    
+    if (!success) http_not_found(job->conn);
+    http_complete(job->server, job->conn);
+    free(job);
+}
+
+void handle_request(HttpServer *server, HttpConn *conn) {
+    HttpReq *request = &conn->request;
+    printf("INFO: %s %s\n", request->method, request->path);
+    if (strcmp(request->path, "/report") == 0 ||
+        (strncmp(request->path, CONVERT_PATH, strlen(CONVERT_PATH)) == 0 &&
+        strlen(&request->path[strlen(CONVERT_PATH)]) > 0)) {
+        PipelineJob *job = malloc(sizeof(PipelineJob));
+        job->server = server;
+        job->conn = conn;
+        if (!pool_try_submit(&workers, job)) {
+            dprintf(2, "ERROR: All workers are busy, rejecting %s\n", request->path);
+            free(job);
+            http_unavailable(conn);
+            http_complete(server, conn);
+        }
+        return;
+    }
+    HttpResp response = {0};
+    if (!serve_static_file(request, &response, conn)) http_not_found(conn);
+    http_complete(server, conn);
+}
+
 // TODO close socket on SIGINT
 int serve() {
     int sockfd = http_server(PORT);
@@ -652,27 +1400,20 @@ int serve() {
         dprintf(2, "Could not create server\n");
         return 1;
     }
-    printf("INFO: Started HTTP server at http://localhost:%d\n", PORT);
-    HttpReq request = {0};
-    HttpResp response = {0};
-    response.body.ptr = malloc(FILE_BUF_SIZE);
-    response.body.cap = FILE_BUF_SIZE;
-    for (;;) {
-        int clientfd = http_next_request(sockfd, &request);
-        if (clientfd < 0) continue;
-        printf("INFO: %s %s\n", request.method, request.path);
-        if (strcmp(request.path, "/report") == 0) {
-            serve_report(&request, &response, clientfd);
-        } else if (strncmp(request.path, CONVERT_PATH, strlen(CONVERT_PATH)) == 0 &&
-            strlen(&request.path[strlen(CONVERT_PATH)]) > 0) {
-            if (!serve_convert(&request, &response, clientfd)) http_not_found(clientfd);
-        } else {
-            if (!serve_static_file(&request, &response, clientfd)) http_not_found(clientfd);
-        }
-        close(clientfd);
+    if (!stages_start()) {
+        dprintf(2, "Could not start pipeline stages\n");
+        return 1;
+    }
+    size_t workers_count = config.workers > 0 ? config.workers : pool_cpu_count();
+    void **contexts = malloc(workers_count*sizeof(void*));
+    for (size_t i = 0; i < workers_count; i++) contexts[i] = worker_alloc(i);
+    if (!pool_start(&workers, workers_count, workers_count*JOBS_PER_WORKER, pipeline_job, contexts, NULL)) {
+        dprintf(2, "Could not start workers\n");
+        return 1;
     }
-    free(response.body.ptr);
-    return 0;
+    printf("INFO: Started HTTP server at http://localhost:%d with %zu workers\n", PORT, workers_count);
+    static HttpServer server;
+    return http_loop(&server, sockfd, handle_request) < 0;
 }
 
 size_t replace_slash_with_0(char *str, char *dst) {
@@ -689,17 +1430,73 @@ size_t replace_slash_with_0(char *str, char *dst) {
     return parts;
 }
 
+typedef struct {
+    char *name;
+    size_t *value;
+} Option;
+
+static Option options[] = {
+    {"--workers", &config.workers},
+    {"--max-image-bytes", &config.max_image_bytes},
+    {"--max-pixels", &config.max_pixels},
+    {"--report-bytes", &config.report_bytes},
+    {"--page-bytes", &config.page_bytes},
+    {"--css-depth", &config.css_depth},
+    {"--css-bytes", &config.css_bytes},
+    {"--decode-threads", &config.decode_threads},
+    {"--encode-threads", &config.encode_threads},
+    {"--avif-speed", &config.avif_speed},
+    {"--avif-quality", &config.avif_quality},
+    {"--avif-threads", &config.avif_threads},
+    {"--avif-tile-log2", &config.avif_tile_log2},
+    {"--debug", &config.debug},
+};
+
+// Takes `--name=value` options out of argv, leaving only positional arguments
+bool parse_options(int *argc, char **argv) {
+    int positional = 1;
+    for (int i = 1; i < *argc; i++) {
+        char *arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0) {
+            argv[positional++] = arg;
+            continue;
+        }
+        char *value = strchr(arg, '=');
+        if (value == NULL) {
+            dprintf(2, "ERROR: Option %s needs a value\n", arg);
+            return FALSE;
+        }
+        *value++ = '\0';
+        size_t opt = 0;
+        for (; opt < sizeof(options)/sizeof(options[0]) && strcmp(options[opt].name, arg) != 0; opt++);
+        if (opt == sizeof(options)/sizeof(options[0])) {
+            dprintf(2, "ERROR: Unknown option %s\n", arg);
+            return FALSE;
+        }
+        *options[opt].value = strtoull(value, NULL, 10);
+    }
+    *argc = positional;
+    return TRUE;
+}
+
 int main(int argc, char **argv) {
+    if (!parse_options(&argc, argv)) {
+        dprintf(2, "ERROR: %s [--workers=N] [--max-image-bytes=N] [--max-pixels=N] [--report-bytes=N] [--page-bytes=N] [--css-depth=N] [--css-bytes=N] [--decode-threads=N] [--encode-threads=N] [--avif-speed=N] [--avif-quality=N] [--avif-threads=N] [--avif-tile-log2=N] [--debug=1] [<in_url> <out_ext>]\n", argv[0]);
+        return 1;
+    }
+    if (!fetch_global_init()) return 1;
+    buf_pool_init(&pixel_pool, PIXEL_POOL_MAX_BYTES);
+    buf_pool_init(&encoded_pool, ENCODED_POOL_MAX_BYTES);
     if (argc > 1) {
         if (argc != 3) {
-            dprintf(2, "ERROR: %s <in_url> <out_ext>\n", argv[0]);
+            dprintf(2, "ERROR: %s [--workers=N] [--max-image-bytes=N] [--max-pixels=N] [--report-bytes=N] [--page-bytes=N] [--css-depth=N] [--css-bytes=N] [--decode-threads=N] [--encode-threads=N] [--avif-speed=N] [--avif-quality=N] [--avif-threads=N] [--avif-tile-log2=N] [--debug=1] [<in_url> <out_ext>]\n", argv[0]);
             return 1;
         }
         
         char *full_src = argv[1];
        
         char *out_ext = argv[2];
-        size_t encoded_size = encode_by_url(full_src, out_ext, encode_buf);
+        Worker *worker = worker_alloc(0);
         
         char img_host[128];
         http_get_host(img_host, full_src);
@@ -720,20 +1517,26 @@ int main(int argc, char **argv) {
         strcpy(out_file_path + strlen(out_file_path), ".");
         strcpy(out_file_path + strlen(out_file_path), out_ext);
     
+        int mkdir_ok = mkdir_p(out_file_path);
+        if (!mkdir_ok) {
+            dprintf(2, "ERROR: Could not mkdir %s\n", out_file_path);
+            // return 1;
+        }
+        int out_fd = open(out_file_path, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+        if (out_fd < 0) {
+            dprintf(2, "ERROR: Could not open %s: %s\n", out_file_path, strerror(errno));
+            return 1;
+        }
+        // The encoders write straight to the file, the buffer only collects
+        // what has not been written yet
+        Sink sink;
+        sink_fd(&sink, out_fd, worker->encoder.buf, worker->encoder.buf_cap);
         printf("INFO: Encoding %s into %s\n", full_src, out_file_path);
-        if (encoded_size > 0) {
-            int mkdir_ok = mkdir_p(out_file_path);
-            if (!mkdir_ok) {
-                dprintf(2, "ERROR: Could not mkdir %s\n", out_file_path);
-                // return 1;
-            }
-            int out_fd = open(out_file_path, O_CREAT|O_WRONLY, 0644);
-            if (write(out_fd, encode_buf, encoded_size) < 0) {
-                dprintf(2, "ERROR: Could not write to %s: %s\n", out_file_path, strerror(errno));
-            }
-            close(out_fd);
-        } else {
+        size_t encoded_size = encode_by_url(worker, full_src, out_ext, &sink);
+        close(out_fd);
+        if (encoded_size == 0) {
             dprintf(2, "ERROR: Could not encode image\n");
+            unlink(out_file_path);
             return 1;
         }
         char bytes_str[32];
@@ -0,0 +1,150 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+typedef void (*PoolFunc)(void *ctx, void *job);
+// Estimated work of a job, for pools that run the most expensive job first
+typedef size_t (*PoolCost)(void *job);
+
+// Fixed set of threads draining a bounded job queue. Every thread gets its
+// own context, so workers can own buffers that are never shared.
+//
+// Without a cost function jobs run in the order they were submitted. With
+// one, a free thread takes the queued job with the highest cost, so long
+// jobs start early and short ones fill the gaps at the end.
+typedef struct {
+    pthread_t *threads;
+    size_t threads_count;
+    void **contexts;
+    PoolFunc func;
+    PoolCost cost;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void **jobs;
+    size_t cap;
+    size_t head;
+    size_t len;
+    bool stopping;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    size_t i;
+} PoolThreadArg;
+
+size_t pool_cpu_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+// Moves the queued job with the highest cost to the head of the queue,
+// keeping submission order between equal costs
+void pool_take_costliest(Pool *pool) {
+    size_t best = pool->head;
+    size_t best_cost = pool->cost(pool->jobs[best]);
+    for (size_t i = 1; i < pool->len; i++) {
+        size_t at = (pool->head + i) % pool->cap;
+        size_t cost = pool->cost(pool->jobs[at]);
+        if (cost > best_cost) {
+            best = at;
+            best_cost = cost;
+        }
+    }
+    void *job = pool->jobs[best];
+    pool->jobs[best] = pool->jobs[pool->head];
+    pool->jobs[pool->head] = job;
+}
+
+void *pool_pthread(void *void_arg) {
+    PoolThreadArg *arg = (PoolThreadArg*)void_arg;
+    Pool *pool = arg->pool;
+    void *ctx = pool->contexts ? pool->contexts[arg->i] : NULL;
+    free(arg);
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->len == 0 && !pool->stopping) pthread_cond_wait(&pool->not_empty, &pool->lock);
+        if (pool->len == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        if (pool->cost != NULL) pool_take_costliest(pool);
+        void *job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->cap;
+        pool->len--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->func(ctx, job);
+    }
+}
+
+// `contexts` may be NULL, otherwise it must hold `threads` entries. `cost`
+// may be NULL for a plain FIFO queue.
+bool pool_start(Pool *pool, size_t threads, size_t cap, PoolFunc func, void **contexts, PoolCost cost) {
+    pool->threads = malloc(threads*sizeof(pthread_t));
+    pool->threads_count = 0;
+    pool->contexts = contexts;
+    pool->func = func;
+    pool->cost = cost;
+    pool->jobs = malloc(cap*sizeof(void*));
+    pool->cap = cap;
+    pool->head = 0;
+    pool->len = 0;
+    pool->stopping = false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    for (size_t i = 0; i < threads; i++) {
+        PoolThreadArg *arg = malloc(sizeof(PoolThreadArg));
+        arg->pool = pool;
+        arg->i = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_pthread, arg) != 0) {
+            dprintf(2, "ERROR: Could not create pool thread\n");
+            free(arg);
+            return false;
+        }
+        pool->threads_count++;
+    }
+    return true;
+}
+
+void pool_push_locked(Pool *pool, void *job) {
+    pool->jobs[(pool->head + pool->len) % pool->cap] = job;
+    pool->len++;
+    pthread_cond_signal(&pool->not_empty);
+}
+
+// Blocks while the queue is full
+void pool_submit(Pool *pool, void *job) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->len == pool->cap) pthread_cond_wait(&pool->not_full, &pool->lock);
+    pool_push_locked(pool, job);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Never blocks, returns false if the queue is full
+bool pool_try_submit(Pool *pool, void *job) {
+    pthread_mutex_lock(&pool->lock);
+    bool ok = pool->len < pool->cap;
+    if (ok) pool_push_locked(pool, job);
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+// Lets the queued jobs finish and joins all threads
+void pool_stop(Pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->threads_count; i++) pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    free(pool->jobs);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+}
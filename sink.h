@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Where encoders put their output. Encoders write straight into the window
+// [ptr+len, ptr+cap) and call sink_flush once it is full, which makes room
+// by handing the bytes on or fails. So a sink in memory gets the bytes
+// without any copy in between, moving them only when its buffer grows, and
+// one over a file descriptor writes them out a window at a time.
+//
+// A failed sink still gives encoders that write into its window room to
+// write into, dropping the bytes, so those that can't stop halfway don't
+// need a way out.
+typedef struct Sink Sink;
+
+struct Sink {
+    char *ptr;
+    size_t len;
+    size_t cap;
+    // Makes room for `need` more bytes, false if it can't
+    bool (*flush)(Sink *sink, size_t need);
+    // Bytes flushed before the current window
+    size_t flushed;
+    int fd;
+    // Where a sink in memory gets its buffers from and gives them back to
+    BufPool *pool;
+    bool failed;
+};
+
+bool sink_flush(Sink *sink, size_t need) {
+    if (!sink->failed && sink->flush(sink, need)) return true;
+    sink->failed = true;
+    sink->len = 0;
+    return false;
+}
+
+bool sink_write(Sink *sink, const void *data, size_t size) {
+    const char *bytes = (const char*)data;
+    while (size > 0 && !sink->failed) {
+        if (sink->len == sink->cap) {
+            if (!sink_flush(sink, size)) return false;
+        }
+        size_t n = sink->cap - sink->len < size ? sink->cap - sink->len : size;
+        memcpy(sink->ptr + sink->len, bytes, n);
+        sink->len += n;
+        bytes += n;
+        size -= n;
+    }
+    return !sink->failed;
+}
+
+// Total bytes written so far
+size_t sink_size(Sink *sink) {
+    return sink->flushed + sink->len;
+}
+
+// Moves the output into a pooled buffer at least twice as big
+bool sink_memory_grow(Sink *sink, size_t need) {
+    size_t cap = sink->cap*2 > sink->len + need ? sink->cap*2 : sink->len + need;
+    Buf buf = buf_pool_get(sink->pool, cap);
+    if (buf.ptr == NULL) {
+        dprintf(2, "ERROR: Could not allocate %zu bytes for an encoded image\n", cap);
+        return false;
+    }
+    memcpy(buf.ptr, sink->ptr, sink->len);
+    Buf old = {.ptr = sink->ptr, .cap = sink->cap};
+    buf_pool_put(sink->pool, old);
+    sink->ptr = buf.ptr;
+    sink->cap = buf.cap;
+    return true;
+}
+
+// Collects the output in a buffer from `pool`, starting with room for
+// `size_hint` bytes and growing as needed. The caller takes the buffer with
+// sink_memory_take or gives it back with sink_memory_release.
+void sink_memory(Sink *sink, BufPool *pool, size_t size_hint) {
+    memset(sink, 0, sizeof(Sink));
+    sink->pool = pool;
+    sink->flush = sink_memory_grow;
+    sink->fd = -1;
+    Buf buf = buf_pool_get(pool, size_hint > 0 ? size_hint : 1);
+    sink->ptr = buf.ptr;
+    sink->cap = buf.ptr != NULL ? buf.cap : 0;
+}
+
+// Hands the buffer over, which its new owner gives back to the pool
+Buf sink_memory_take(Sink *sink) {
+    Buf buf = {.ptr = sink->ptr, .cap = sink->cap};
+    sink->ptr = NULL;
+    sink->len = 0;
+    sink->cap = 0;
+    return buf;
+}
+
+void sink_memory_release(Sink *sink) {
+    buf_pool_put(sink->pool, sink_memory_take(sink));
+}
+
+bool sink_fd_flush(Sink *sink, size_t _need) {
+    size_t sent = 0;
+    while (sent < sink->len) {
+        ssize_t n = write(sink->fd, sink->ptr + sent, sink->len - sent);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            dprintf(2, "ERROR: Could not write encoded image: %s\n", strerror(errno));
+            return false;
+        }
+        sent += n;
+    }
+    sink->flushed += sink->len;
+    sink->len = 0;
+    return true;
+}
+
+// Writes the output to `fd`, with `buf` holding what has not been written yet
+void sink_fd(Sink *sink, int fd, char *buf, size_t cap) {
+    memset(sink, 0, sizeof(Sink));
+    sink->ptr = buf;
+    sink->cap = cap;
+    sink->flush = sink_fd_flush;
+    sink->fd = fd;
+}
+
+// To be called after the encoder is done. Flushes the rest to the file
+// descriptor, returns false if any of the output was lost.
+bool sink_finish(Sink *sink) {
+    if (sink->fd >= 0 && sink->len > 0) sink_flush(sink, 0);
+    return !sink->failed;
+}
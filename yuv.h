@@ -0,0 +1,238 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// RGB to YCbCr 4:2:0 conversion done once per decoded image and shared by
+// the lossy encoders, which would otherwise each convert and subsample the
+// same pixels again.
+//
+// Samples are full range BT.601 like in JFIF, so libjpeg takes the planes
+// as they are. Chroma is the average of each 2x2 block. The planes are
+// padded to whole 16x16 macroblocks by repeating the last column and row,
+// which libjpeg's raw data input needs.
+
+// Coefficients scaled by 2^YUV_SHIFT
+#define YUV_SHIFT 14
+#define YUV_Y_R 4899
+#define YUV_Y_G 9617
+#define YUV_Y_B 1868
+#define YUV_CB_R -2765
+#define YUV_CB_G -5427
+#define YUV_CB_B 8192
+#define YUV_CR_R 8192
+#define YUV_CR_G -6860
+#define YUV_CR_B -1332
+
+typedef struct {
+    int w;
+    int h;
+    unsigned char *y;
+    unsigned char *u;
+    unsigned char *v;
+    // Only for images with alpha, at full resolution with `y_stride`
+    unsigned char *a;
+    int y_stride;
+    int uv_stride;
+    // Rows of the padded planes
+    int y_rows;
+    int uv_rows;
+    // All planes live in this one buffer
+    Buf buf;
+} Yuv420;
+
+unsigned char yuv_luma(const unsigned char *p) {
+    return (YUV_Y_R*p[0] + YUV_Y_G*p[1] + YUV_Y_B*p[2] + (1 << (YUV_SHIFT-1))) >> YUV_SHIFT;
+}
+
+// From the sums of the 2x2 block's channels
+unsigned char yuv_chroma(int r, int g, int b, int cr, int cg, int cb) {
+    int c = (cr*r + cg*g + cb*b + (128 << (YUV_SHIFT+2)) + (1 << (YUV_SHIFT+1))) >> (YUV_SHIFT+2);
+    return c > 255 ? 255 : c;
+}
+
+// Converts the row pair `row0` and `row1`, which are the same row at the
+// bottom of images with an odd height
+void yuv420_rows(Yuv420 *yuv, const unsigned char *row0, const unsigned char *row1, int n,
+                 unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v) {
+    int w = yuv->w;
+    int x = 0;
+#ifdef __SSE2__
+    // Four pixels per step, each in a 32-bit lane as R | G<<8 | B<<16. The
+    // lane masked to (R, B) and shifted to (G, A) are int16 pairs, so a
+    // madd per pair gets the weighted sum. RGB pixels are loaded as 4 bytes,
+    // so the steps stop before the row's last pixel to not read past it.
+    int simd_w = n == 4 ? w : w - 1;
+    const __m128i mask = _mm_set1_epi32(0x00ff00ff);
+    const __m128i y_rb = _mm_set_epi16(YUV_Y_B, YUV_Y_R, YUV_Y_B, YUV_Y_R, YUV_Y_B, YUV_Y_R, YUV_Y_B, YUV_Y_R);
+    const __m128i y_ga = _mm_set_epi16(0, YUV_Y_G, 0, YUV_Y_G, 0, YUV_Y_G, 0, YUV_Y_G);
+    const __m128i cb_rb = _mm_set_epi16(YUV_CB_B, YUV_CB_R, YUV_CB_B, YUV_CB_R, YUV_CB_B, YUV_CB_R, YUV_CB_B, YUV_CB_R);
+    const __m128i cb_ga = _mm_set_epi16(0, YUV_CB_G, 0, YUV_CB_G, 0, YUV_CB_G, 0, YUV_CB_G);
+    const __m128i cr_rb = _mm_set_epi16(YUV_CR_B, YUV_CR_R, YUV_CR_B, YUV_CR_R, YUV_CR_B, YUV_CR_R, YUV_CR_B, YUV_CR_R);
+    const __m128i cr_ga = _mm_set_epi16(0, YUV_CR_G, 0, YUV_CR_G, 0, YUV_CR_G, 0, YUV_CR_G);
+    const __m128i y_round = _mm_set1_epi32(1 << (YUV_SHIFT-1));
+    const __m128i c_offset = _mm_set1_epi32((128 << (YUV_SHIFT+2)) + (1 << (YUV_SHIFT+1)));
+    for (; x + 4 <= simd_w; x += 4) {
+        __m128i px0, px1;
+        if (n == 4) {
+            px0 = _mm_loadu_si128((const __m128i*)(row0 + x*4));
+            px1 = _mm_loadu_si128((const __m128i*)(row1 + x*4));
+        } else {
+            uint32_t p0[4], p1[4];
+            for (int i = 0; i < 4; i++) {
+                memcpy(&p0[i], row0 + (x+i)*3, 4);
+                memcpy(&p1[i], row1 + (x+i)*3, 4);
+            }
+            px0 = _mm_loadu_si128((const __m128i*)p0);
+            px1 = _mm_loadu_si128((const __m128i*)p1);
+        }
+        __m128i rb0 = _mm_and_si128(px0, mask);
+        __m128i ga0 = _mm_and_si128(_mm_srli_epi32(px0, 8), mask);
+        __m128i rb1 = _mm_and_si128(px1, mask);
+        __m128i ga1 = _mm_and_si128(_mm_srli_epi32(px1, 8), mask);
+
+        __m128i luma0 = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rb0, y_rb), _mm_madd_epi16(ga0, y_ga)), y_round);
+        __m128i luma1 = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rb1, y_rb), _mm_madd_epi16(ga1, y_ga)), y_round);
+        __m128i luma = _mm_packs_epi32(_mm_srli_epi32(luma0, YUV_SHIFT), _mm_srli_epi32(luma1, YUV_SHIFT));
+        luma = _mm_packus_epi16(luma, luma);
+        uint32_t luma_row0 = _mm_cvtsi128_si32(luma);
+        uint32_t luma_row1 = _mm_cvtsi128_si32(_mm_srli_si128(luma, 4));
+        memcpy(y0 + x, &luma_row0, 4);
+        memcpy(y1 + x, &luma_row1, 4);
+
+        // Sums of each 2x2 block end up in lanes 0 and 2
+        __m128i rb = _mm_add_epi16(rb0, rb1);
+        __m128i ga = _mm_add_epi16(ga0, ga1);
+        rb = _mm_add_epi16(rb, _mm_shuffle_epi32(rb, _MM_SHUFFLE(2, 3, 0, 1)));
+        ga = _mm_add_epi16(ga, _mm_shuffle_epi32(ga, _MM_SHUFFLE(2, 3, 0, 1)));
+        __m128i cb = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rb, cb_rb), _mm_madd_epi16(ga, cb_ga)), c_offset);
+        __m128i cr = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rb, cr_rb), _mm_madd_epi16(ga, cr_ga)), c_offset);
+        __m128i chroma = _mm_packs_epi32(_mm_srai_epi32(cb, YUV_SHIFT+2), _mm_srai_epi32(cr, YUV_SHIFT+2));
+        chroma = _mm_packus_epi16(chroma, chroma);
+        uint32_t cbs = _mm_cvtsi128_si32(chroma);
+        uint32_t crs = _mm_cvtsi128_si32(_mm_srli_si128(chroma, 4));
+        u[x/2] = cbs;
+        u[x/2+1] = cbs >> 16;
+        v[x/2] = crs;
+        v[x/2+1] = crs >> 16;
+    }
+#endif
+    for (; x < w; x += 2) {
+        int x1 = x + 1 < w ? x + 1 : x;
+        const unsigned char *p00 = row0 + x*n, *p01 = row0 + x1*n;
+        const unsigned char *p10 = row1 + x*n, *p11 = row1 + x1*n;
+        y0[x] = yuv_luma(p00);
+        y1[x] = yuv_luma(p10);
+        y0[x1] = yuv_luma(p01);
+        y1[x1] = yuv_luma(p11);
+        int r = p00[0] + p01[0] + p10[0] + p11[0];
+        int g = p00[1] + p01[1] + p10[1] + p11[1];
+        int b = p00[2] + p01[2] + p10[2] + p11[2];
+        u[x/2] = yuv_chroma(r, g, b, YUV_CB_R, YUV_CB_G, YUV_CB_B);
+        v[x/2] = yuv_chroma(r, g, b, YUV_CR_R, YUV_CR_G, YUV_CR_B);
+    }
+}
+
+// Repeats the last sample of the row up to the padded width
+void yuv420_pad_row(unsigned char *row, int w, int stride) {
+    memset(row + w, row[w-1], stride - w);
+}
+
+// `n` is 3 for RGB or 4 for RGBA. `pool` may be NULL.
+bool yuv420_from_rgb(Yuv420 *yuv, const unsigned char *pixels, int w, int h, int n, BufPool *pool) {
+    memset(yuv, 0, sizeof(Yuv420));
+    if (w <= 0 || h <= 0 || (n != 3 && n != 4)) {
+        dprintf(2, "ERROR: Can't convert %dx%dx%d pixels to YUV\n", w, h, n);
+        return false;
+    }
+    yuv->w = w;
+    yuv->h = h;
+    yuv->y_stride = (w + 15) & ~15;
+    yuv->uv_stride = yuv->y_stride/2;
+    yuv->y_rows = (h + 15) & ~15;
+    yuv->uv_rows = yuv->y_rows/2;
+    size_t y_size = (size_t)yuv->y_stride*yuv->y_rows;
+    size_t uv_size = (size_t)yuv->uv_stride*yuv->uv_rows;
+    size_t a_size = n == 4 ? (size_t)yuv->y_stride*h : 0;
+    size_t size = y_size + 2*uv_size + a_size;
+    if (pool != NULL) {
+        yuv->buf = buf_pool_get(pool, size);
+    } else {
+        yuv->buf.ptr = malloc(size);
+        yuv->buf.cap = size;
+    }
+    if (yuv->buf.ptr == NULL) return false;
+    yuv->y = (unsigned char*)yuv->buf.ptr;
+    yuv->u = yuv->y + y_size;
+    yuv->v = yuv->u + uv_size;
+    if (n == 4) yuv->a = yuv->v + uv_size;
+
+    size_t stride = (size_t)w*n;
+    int uv_w = (w + 1)/2;
+    for (int y = 0; y < h; y += 2) {
+        const unsigned char *row0 = pixels + y*stride;
+        const unsigned char *row1 = y + 1 < h ? row0 + stride : row0;
+        unsigned char *y0 = yuv->y + (size_t)y*yuv->y_stride;
+        unsigned char *u = yuv->u + (size_t)(y/2)*yuv->uv_stride;
+        unsigned char *v = yuv->v + (size_t)(y/2)*yuv->uv_stride;
+        // The odd last row goes into the padding, which is overwritten below
+        yuv420_rows(yuv, row0, row1, n, y0, y0 + yuv->y_stride, u, v);
+        yuv420_pad_row(y0, w, yuv->y_stride);
+        yuv420_pad_row(y0 + yuv->y_stride, w, yuv->y_stride);
+        yuv420_pad_row(u, uv_w, yuv->uv_stride);
+        yuv420_pad_row(v, uv_w, yuv->uv_stride);
+    }
+    unsigned char *last_y = yuv->y + (size_t)(h-1)*yuv->y_stride;
+    for (int y = h; y < yuv->y_rows; y++) memcpy(yuv->y + (size_t)y*yuv->y_stride, last_y, yuv->y_stride);
+    int uv_h = (h + 1)/2;
+    unsigned char *last_u = yuv->u + (size_t)(uv_h-1)*yuv->uv_stride;
+    unsigned char *last_v = yuv->v + (size_t)(uv_h-1)*yuv->uv_stride;
+    for (int y = uv_h; y < yuv->uv_rows; y++) {
+        memcpy(yuv->u + (size_t)y*yuv->uv_stride, last_u, yuv->uv_stride);
+        memcpy(yuv->v + (size_t)y*yuv->uv_stride, last_v, yuv->uv_stride);
+    }
+
+    if (yuv->a != NULL) {
+        for (int y = 0; y < h; y++) {
+            const unsigned char *row = pixels + y*stride;
+            unsigned char *a = yuv->a + (size_t)y*yuv->y_stride;
+            for (int x = 0; x < w; x++) a[x] = row[x*4 + 3];
+        }
+    }
+    return true;
+}
+
+// Writes the planes in limited range (16-235 luma, 16-240 chroma), which is
+// what VP8 expects
+void yuv420_to_limited(const Yuv420 *yuv, unsigned char *y, int y_stride, unsigned char *u, unsigned char *v, int uv_stride) {
+    unsigned char luma[256], chroma[256];
+    for (int i = 0; i < 256; i++) {
+        luma[i] = 16 + (i*219 + 127)/255;
+        chroma[i] = 16 + (i*224 + 127)/255;
+    }
+    for (int row = 0; row < yuv->h; row++) {
+        const unsigned char *src = yuv->y + (size_t)row*yuv->y_stride;
+        unsigned char *dst = y + (size_t)row*y_stride;
+        for (int x = 0; x < yuv->w; x++) dst[x] = luma[src[x]];
+    }
+    int uv_w = (yuv->w + 1)/2;
+    for (int row = 0; row < (yuv->h + 1)/2; row++) {
+        const unsigned char *src_u = yuv->u + (size_t)row*yuv->uv_stride;
+        const unsigned char *src_v = yuv->v + (size_t)row*yuv->uv_stride;
+        unsigned char *dst_u = u + (size_t)row*uv_stride;
+        unsigned char *dst_v = v + (size_t)row*uv_stride;
+        for (int x = 0; x < uv_w; x++) {
+            dst_u[x] = chroma[src_u[x]];
+            dst_v[x] = chroma[src_v[x]];
+        }
+    }
+}
+
+void yuv420_free(Yuv420 *yuv, BufPool *pool) {
+    if (pool != NULL) buf_pool_put(pool, yuv->buf);
+    else free(yuv->buf.ptr);
+    yuv->buf.ptr = NULL;
+    yuv->y = NULL;
+}